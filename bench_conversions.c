@@ -0,0 +1,344 @@
+// Microbenchmarks for the per-message conversion paths in rbus_json.c. Each
+// case runs for a fixed time and reports ns/op and heap allocations/op. Only
+// librbus's value types are used, so no broker is needed.
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "rbus_json.h"
+#include "rbus_arena.h"
+
+#define BYTES_LEN 65536
+
+// Count heap allocations by wrapping glibc's allocator. This also sees
+// allocations made inside jansson and librbus.
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static uint64_t allocations = 0;
+
+void *malloc(size_t size) {
+   __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+   return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+   __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+   return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+   __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+   return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+   __libc_free(ptr);
+}
+
+static uint64_t allocation_count(void) {
+   return __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+}
+#else
+static uint64_t allocation_count(void) {
+   return 0;
+}
+#endif
+
+static double min_seconds = 0.5;
+static Arena bench_arena;
+
+static int64_t monotonic_ns(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Run op in batches until min_seconds have passed and print its cost
+static void run(const char *name, void (*op)(void *), void *arg) {
+   for (int i = 0; i < 16; i++) {
+      op(arg);
+   }
+
+   uint64_t iterations = 0;
+   uint64_t batch = 1;
+   uint64_t allocs_before = allocation_count();
+   int64_t start_ns = monotonic_ns();
+   int64_t elapsed_ns = 0;
+   while (elapsed_ns < (int64_t)(min_seconds * 1e9)) {
+      for (uint64_t i = 0; i < batch; i++) {
+         op(arg);
+      }
+      iterations += batch;
+      if (batch < (1 << 20)) {
+         batch *= 2;
+      }
+      elapsed_ns = monotonic_ns() - start_ns;
+   }
+   uint64_t allocs = allocation_count() - allocs_before;
+
+   printf("%-36s %12.1f ns/op %10.1f allocs/op %12llu ops\n", name, (double)elapsed_ns / (double)iterations,
+      (double)allocs / (double)iterations, (unsigned long long)iterations);
+}
+
+// rbus -> JSON
+static void op_rbus_to_json(void *arg) {
+   json_decref(rbus_value_to_json((rbusValue_t)arg));
+}
+
+// JSON -> rbus
+static void op_json_to_rbus(void *arg) {
+   rbusValue_t value = json_to_rbus_value((json_t *)arg);
+   if (value) {
+      rbusValue_Release(value);
+   }
+}
+
+// What the server does with each inbound frame before dispatching it
+static void op_parse_request(void *arg) {
+   const char *text = (const char *)arg;
+   json_error_t error;
+   json_decref(json_loadb(text, strlen(text), 0, &error));
+}
+
+static void op_parse_request_arena(void *arg) {
+   arena_enable(true);
+   op_parse_request(arg);
+   arena_enable(false);
+   arena_reset(&bench_arena);
+}
+
+static void op_path_list(void *arg) {
+   PathList list;
+   path_list_init(&list, (json_t *)arg);
+   path_list_free(&list);
+}
+
+// A typical rbus_get result: a few properties keyed by path
+static void op_success_response(void *arg) {
+   json_t *id = (json_t *)arg;
+   json_t *result = json_object();
+   json_object_set_new(result, "Device.DeviceInfo.ModelName", json_string("XB8"));
+   json_object_set_new(result, "Device.DeviceInfo.SerialNumber", json_string("SN0123456789"));
+   json_object_set_new(result, "Device.DeviceInfo.UpTime", json_integer(123456));
+   json_object_set_new(result, "Device.WiFi.Radio.1.Enable", json_true());
+   json_t *response = create_success_response(result, id);
+   char *text = json_dumps(response, JSON_COMPACT);
+   arena_free(text);
+   json_decref(response);
+}
+
+// The same with jansson allocating from a request arena, as the server does
+static void op_success_response_arena(void *arg) {
+   arena_enable(true);
+   op_success_response(arg);
+   arena_enable(false);
+   arena_reset(&bench_arena);
+}
+
+// What event_handler and write_pending_events do per event: params, the
+// rbus_event notification around them, and its serialization
+static void op_event_notification(void *arg) {
+   const rbusEvent_t *event = (const rbusEvent_t *)arg;
+   json_t *params = create_event_params(event, rbusObject_GetValue(event->data, "value"));
+   json_object_set_new(params, "seq", json_integer(42));
+   json_t *notification = create_notification("rbus_event", params);
+   char *text = json_dumps(notification, JSON_COMPACT);
+   free(text);
+   json_decref(notification);
+}
+
+static rbusValue_t new_value(void) {
+   rbusValue_t value;
+   rbusValue_Init(&value);
+   return value;
+}
+
+// An object nested two deep, like a table row with a sub-object
+static rbusValue_t new_object_value(void) {
+   rbusObject_t inner;
+   rbusObject_Init(&inner, NULL);
+   rbusValue_t field = new_value();
+   rbusValue_SetString(field, "eth0");
+   rbusObject_SetValue(inner, "Name", field);
+   rbusValue_Release(field);
+   field = new_value();
+   rbusValue_SetUInt32(field, 1500);
+   rbusObject_SetValue(inner, "MTU", field);
+   rbusValue_Release(field);
+
+   rbusObject_t outer;
+   rbusObject_Init(&outer, NULL);
+   field = new_value();
+   rbusValue_SetString(field, "Up");
+   rbusObject_SetValue(outer, "Status", field);
+   rbusValue_Release(field);
+   field = new_value();
+   rbusValue_SetInt64(field, 987654321);
+   rbusObject_SetValue(outer, "BytesSent", field);
+   rbusValue_Release(field);
+   field = new_value();
+   rbusValue_SetBoolean(field, true);
+   rbusObject_SetValue(outer, "Enable", field);
+   rbusValue_Release(field);
+   field = new_value();
+   rbusValue_SetObject(field, inner);
+   rbusObject_SetValue(outer, "Interface", field);
+   rbusValue_Release(field);
+   rbusObject_Release(inner);
+
+   rbusValue_t value = new_value();
+   rbusValue_SetObject(value, outer);
+   rbusObject_Release(outer);
+   return value;
+}
+
+int main(int argc, char *argv[]) {
+   if (argc > 1) {
+      min_seconds = atof(argv[1]);
+      if (min_seconds <= 0) {
+         fprintf(stderr, "Usage: %s [seconds_per_case]\n", argv[0]);
+         return 1;
+      }
+   }
+   rbus_setLogLevel(RBUS_LOG_ERROR);
+   arena_install_json();
+   if (arena_init(&bench_arena, 16384) != 0) {
+      return 1;
+   }
+   arena_bind(&bench_arena);
+
+   uint8_t *bytes = malloc(BYTES_LEN);
+   if (!bytes) {
+      return 1;
+   }
+   for (int i = 0; i < BYTES_LEN; i++) {
+      bytes[i] = (uint8_t)(i * 31);
+   }
+
+   rbusValue_t string_value = new_value();
+   rbusValue_SetString(string_value, "Device.WiFi.AccessPoint.1.SSID value");
+   rbusValue_t int_value = new_value();
+   rbusValue_SetInt32(int_value, -123456);
+   rbusValue_t uint_value = new_value();
+   rbusValue_SetUInt64(uint_value, 18000000000ULL);
+   rbusValue_t double_value = new_value();
+   rbusValue_SetDouble(double_value, 3.14159);
+   rbusValue_t bool_value = new_value();
+   rbusValue_SetBoolean(bool_value, true);
+   rbusValue_t time_value = new_value();
+   rbusDateTime_t datetime = {0};
+   datetime.m_time.tm_year = 126;
+   datetime.m_time.tm_mon = 9;
+   datetime.m_time.tm_mday = 16;
+   datetime.m_time.tm_hour = 12;
+   datetime.m_time.tm_min = 30;
+   datetime.m_time.tm_sec = 5;
+   rbusValue_SetTime(time_value, &datetime);
+   rbusValue_t bytes_value = new_value();
+   rbusValue_SetBytes(bytes_value, bytes, BYTES_LEN);
+   rbusValue_t object_value = new_object_value();
+
+   printf("rbus_value_to_json\n");
+   run("  string", op_rbus_to_json, string_value);
+   run("  int32", op_rbus_to_json, int_value);
+   run("  uint64", op_rbus_to_json, uint_value);
+   run("  double", op_rbus_to_json, double_value);
+   run("  boolean", op_rbus_to_json, bool_value);
+   run("  datetime", op_rbus_to_json, time_value);
+   run("  object (nested)", op_rbus_to_json, object_value);
+   run("  bytes (64 KB)", op_rbus_to_json, bytes_value);
+
+   json_t *json_text = json_string("Device.WiFi.AccessPoint.1.SSID value");
+   json_t *json_int = json_integer(-123456);
+   json_t *json_double = json_real(3.14159);
+   json_t *json_bool = json_true();
+   json_t *json_object_value = rbus_value_to_json(object_value);
+   json_t *json_bytes = rbus_value_to_json(bytes_value);
+   json_t *json_small_bytes = json_array();
+   for (int i = 0; i < 16; i++) {
+      json_array_append_new(json_small_bytes, json_integer(bytes[i]));
+   }
+
+   printf("json_to_rbus_value\n");
+   run("  string", op_json_to_rbus, json_text);
+   run("  integer", op_json_to_rbus, json_int);
+   run("  real", op_json_to_rbus, json_double);
+   run("  boolean", op_json_to_rbus, json_bool);
+   run("  object (nested)", op_json_to_rbus, json_object_value);
+   run("  bytes (16)", op_json_to_rbus, json_small_bytes);
+   run("  bytes (64 KB)", op_json_to_rbus, json_bytes);
+
+   const char *get_request = "{\"jsonrpc\":\"2.0\",\"method\":\"rbus_get\","
+      "\"params\":{\"path\":\"Device.DeviceInfo.ModelName\"},\"id\":17}";
+   printf("request parsing\n");
+   run("  rbus_get", op_parse_request, (void *)get_request);
+   run("  rbus_get (arena)", op_parse_request_arena, (void *)get_request);
+
+   const char *eight_paths[] = { "Device.DeviceInfo.ModelName", "Device.DeviceInfo.SerialNumber",
+      "Device.DeviceInfo.UpTime", "Device.WiFi.Radio.1.Enable", "Device.WiFi.Radio.1.Channel",
+      "Device.WiFi.SSID.1.SSID", "Device.Ethernet.Interface.1.Status",
+      "Device.IP.Interface.1.IPv4Address.1.IPAddress" };
+   json_t *one_path = json_string(eight_paths[0]);
+   json_t *path_string = json_string(
+      "Device.DeviceInfo.ModelName, Device.DeviceInfo.SerialNumber, Device.DeviceInfo.UpTime, "
+      "Device.WiFi.Radio.1.Enable, Device.WiFi.Radio.1.Channel, Device.WiFi.SSID.1.SSID, "
+      "Device.Ethernet.Interface.1.Status, Device.IP.Interface.1.IPv4Address.1.IPAddress");
+   json_t *path_array = json_array();
+   for (size_t i = 0; i < sizeof(eight_paths) / sizeof(eight_paths[0]); i++) {
+      json_array_append_new(path_array, json_string(eight_paths[i]));
+   }
+
+   printf("path_list_init\n");
+   run("  1 path", op_path_list, one_path);
+   run("  8 paths", op_path_list, path_string);
+   run("  8 paths (array)", op_path_list, path_array);
+
+   printf("create_success_response\n");
+   json_t *id = json_integer(17);
+   run("  4-property result + dump", op_success_response, id);
+   run("  4-property result + dump (arena)", op_success_response_arena, id);
+
+   printf("event notification\n");
+   rbusObject_t string_data;
+   rbusObject_Init(&string_data, NULL);
+   rbusObject_SetValue(string_data, "value", string_value);
+   rbusEvent_t string_event = { .name = "Device.WiFi.SSID.1.SSID", .type = RBUS_EVENT_VALUE_CHANGED, .data = string_data };
+   run("  string value", op_event_notification, &string_event);
+   rbusObject_t object_data;
+   rbusObject_Init(&object_data, NULL);
+   rbusObject_SetValue(object_data, "value", object_value);
+   rbusEvent_t object_event = { .name = "Device.Ethernet.Interface.1.", .type = RBUS_EVENT_GENERAL, .data = object_data };
+   run("  object value", op_event_notification, &object_event);
+
+   rbusObject_Release(string_data);
+   rbusObject_Release(object_data);
+   json_decref(id);
+   json_decref(one_path);
+   json_decref(path_string);
+   json_decref(path_array);
+   json_decref(json_text);
+   json_decref(json_int);
+   json_decref(json_double);
+   json_decref(json_bool);
+   json_decref(json_object_value);
+   json_decref(json_bytes);
+   json_decref(json_small_bytes);
+   rbusValue_Release(string_value);
+   rbusValue_Release(int_value);
+   rbusValue_Release(uint_value);
+   rbusValue_Release(double_value);
+   rbusValue_Release(bool_value);
+   rbusValue_Release(time_value);
+   rbusValue_Release(bytes_value);
+   rbusValue_Release(object_value);
+   free(bytes);
+   arena_bind(NULL);
+   arena_destroy(&bench_arena);
+   return 0;
+}
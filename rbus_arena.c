@@ -0,0 +1,120 @@
+// Per-request bump allocator, and the jansson allocation hooks that use it.
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <jansson.h>
+
+#include "rbus_arena.h"
+
+// Largest block kept across resets; bigger requests still work but get their
+// extra blocks from malloc every time
+#define ARENA_MAX_BLOCK (1024 * 1024)
+#define ARENA_ALIGN sizeof(max_align_t)
+
+static _Thread_local Arena *thread_arena = NULL;
+static _Thread_local bool thread_arena_enabled = false;
+
+static ArenaBlock *new_block(size_t size) {
+   ArenaBlock *block = malloc(sizeof(ArenaBlock) + size);
+   if (block) {
+      block->next = NULL;
+      block->size = size;
+      block->used = 0;
+   }
+   return block;
+}
+
+static void free_blocks(ArenaBlock *block) {
+   while (block) {
+      ArenaBlock *next = block->next;
+      free(block);
+      block = next;
+   }
+}
+
+int arena_init(Arena *arena, size_t block_size) {
+   arena->block_size = (block_size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+   arena->used = 0;
+   arena->blocks = new_block(arena->block_size);
+   return arena->blocks ? 0 : -1;
+}
+
+void arena_destroy(Arena *arena) {
+   free_blocks(arena->blocks);
+   arena->blocks = NULL;
+   arena->used = 0;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+   if (size > SIZE_MAX - ARENA_ALIGN) {
+      return NULL;
+   }
+   size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+   ArenaBlock *block = arena->blocks;
+   if (!block || block->size - block->used < size) {
+      block = new_block(size > arena->block_size ? size : arena->block_size);
+      if (!block) {
+         return NULL;
+      }
+      block->next = arena->blocks;
+      arena->blocks = block;
+   }
+   void *ptr = (char *)block->data + block->used;
+   block->used += size;
+   arena->used += size;
+   return ptr;
+}
+
+void arena_reset(Arena *arena) {
+   if (arena->blocks && arena->blocks->next) {
+      size_t wanted = arena->used < ARENA_MAX_BLOCK ? arena->used : ARENA_MAX_BLOCK;
+      if (wanted > arena->block_size) {
+         arena->block_size = wanted;
+      }
+      free_blocks(arena->blocks);
+      arena->blocks = new_block(arena->block_size);
+   } else if (arena->blocks) {
+      arena->blocks->used = 0;
+   }
+   arena->used = 0;
+}
+
+static bool arena_owns(const Arena *arena, const void *ptr) {
+   for (const ArenaBlock *block = arena->blocks; block; block = block->next) {
+      if ((const char *)ptr >= (const char *)block->data && (const char *)ptr < (const char *)block->data + block->size) {
+         return true;
+      }
+   }
+   return false;
+}
+
+static void *arena_json_malloc(size_t size) {
+   if (thread_arena && thread_arena_enabled) {
+      return arena_alloc(thread_arena, size);
+   }
+   return malloc(size);
+}
+
+// Arena memory is only ever touched by the thread it is bound to, so a pointer
+// from another thread's free is always from malloc
+void arena_free(void *ptr) {
+   if (ptr && thread_arena && arena_owns(thread_arena, ptr)) {
+      return;
+   }
+   free(ptr);
+}
+
+void arena_install_json(void) {
+   json_set_alloc_funcs(arena_json_malloc, arena_free);
+}
+
+void arena_bind(Arena *arena) {
+   thread_arena = arena;
+   thread_arena_enabled = false;
+}
+
+bool arena_enable(bool enable) {
+   bool previous = thread_arena_enabled;
+   thread_arena_enabled = enable;
+   return previous;
+}
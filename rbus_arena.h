@@ -0,0 +1,47 @@
+#ifndef RBUS_ARENA_H
+#define RBUS_ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Bump allocator for memory that lives no longer than one request. Allocations
+// are never freed individually; arena_reset releases them all at once.
+typedef struct ArenaBlock {
+   struct ArenaBlock *next;
+   size_t size;
+   size_t used;
+   max_align_t data[];
+} ArenaBlock;
+
+typedef struct {
+   ArenaBlock *blocks;   // Current block first
+   size_t block_size;    // Size of the block kept across resets
+   size_t used;          // Bytes handed out since the last reset
+} Arena;
+
+int arena_init(Arena *arena, size_t block_size);
+void arena_destroy(Arena *arena);
+void *arena_alloc(Arena *arena, size_t size);
+
+// Release everything allocated since the last reset. If the request needed
+// more than one block, the kept block grows to fit the next one like it.
+void arena_reset(Arena *arena);
+
+// Route jansson's allocations through the arena bound to the calling thread
+// while it is enabled. Threads without a bound arena, and bound threads with
+// the arena disabled, use malloc. Call once, before any other jansson call.
+void arena_install_json(void);
+
+// Bind arena to the calling thread (NULL unbinds). It starts disabled.
+void arena_bind(Arena *arena);
+
+// Enable or disable the calling thread's arena for jansson allocations and
+// return the previous setting. JSON that outlives the request must be built
+// with it disabled.
+bool arena_enable(bool enable);
+
+// Free memory that may be in the calling thread's arena, e.g. json_dumps
+// output. Arena memory is left for arena_reset; anything else is freed.
+void arena_free(void *ptr);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef RBUS_CAPTURE_H
+#define RBUS_CAPTURE_H
+
+#include <stdint.h>
+
+// Traffic capture file format, written by rbus_jsonrpc (capture_file config)
+// and read by rbus_jsonrpc_replay. A CaptureHeader is followed by records, each
+// a CaptureRecord and then length bytes of frame payload. Integers are in host
+// byte order; times are nanoseconds since the capture started.
+#define CAPTURE_MAGIC "RJSONCAP"
+#define CAPTURE_VERSION 1
+
+typedef struct {
+   char magic[8];
+   uint32_t version;
+   uint32_t reserved;
+} CaptureHeader;
+
+typedef enum {
+   CAPTURE_OPEN = 'C',     // Connection established, no payload
+   CAPTURE_INBOUND = 'I',  // Frame received from the client
+   CAPTURE_RESPONSE = 'O', // Response sent to the client
+   CAPTURE_CLOSE = 'X'     // Connection closed, no payload
+} CaptureType;
+
+typedef struct {
+   uint64_t time_ns;
+   uint32_t conn_id;
+   uint32_t length;
+   uint8_t type;           // CaptureType
+   uint8_t reserved[7];
+} CaptureRecord;
+
+#endif
@@ -0,0 +1,82 @@
+// Log-linear latency histogram, see rbus_histogram.h.
+#include "rbus_histogram.h"
+
+static void counter_add(atomic_uint_fast64_t *counter, uint64_t n) {
+   atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+static void counter_max(atomic_uint_fast64_t *counter, uint64_t value) {
+   uint64_t max = atomic_load_explicit(counter, memory_order_relaxed);
+   while (value > max &&
+      !atomic_compare_exchange_weak_explicit(counter, &max, value, memory_order_relaxed, memory_order_relaxed)) {
+   }
+}
+
+static int histogram_index(uint64_t value) {
+   if (value < HISTOGRAM_SUB_COUNT) {
+      return (int)value;
+   }
+   int magnitude = 63 - __builtin_clzll(value);
+   if (magnitude > HISTOGRAM_MAX_MAGNITUDE) {
+      return HISTOGRAM_BUCKETS - 1;
+   }
+   int sub = (int)(value >> (magnitude - HISTOGRAM_SUB_BITS)) - HISTOGRAM_SUB_COUNT;
+   return HISTOGRAM_SUB_COUNT * (magnitude - HISTOGRAM_SUB_BITS + 1) + sub;
+}
+
+// Highest value that falls into a bucket
+static uint64_t histogram_bucket_value(int index) {
+   if (index < HISTOGRAM_SUB_COUNT) {
+      return (uint64_t)index;
+   }
+   int magnitude = index / HISTOGRAM_SUB_COUNT + HISTOGRAM_SUB_BITS - 1;
+   int sub = index % HISTOGRAM_SUB_COUNT;
+   int shift = magnitude - HISTOGRAM_SUB_BITS;
+   return (((uint64_t)(HISTOGRAM_SUB_COUNT + sub + 1)) << shift) - 1;
+}
+
+void histogram_record(Histogram *h, uint64_t value_ns) {
+   counter_add(&h->counts[histogram_index(value_ns)], 1);
+   counter_add(&h->total, 1);
+   counter_add(&h->sum_ns, value_ns);
+   counter_max(&h->max_ns, value_ns);
+}
+
+uint64_t histogram_percentile(Histogram *h, double q) {
+   uint64_t total = atomic_load(&h->total);
+   uint64_t max = atomic_load(&h->max_ns);
+   if (total == 0) {
+      return 0;
+   }
+   uint64_t target = (uint64_t)(q * (double)total + 0.5);
+   if (target < 1) {
+      target = 1;
+   }
+   uint64_t cumulative = 0;
+   for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      cumulative += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+      if (cumulative >= target) {
+         uint64_t value = histogram_bucket_value(i);
+         return value < max ? value : max;
+      }
+   }
+   return max;
+}
+
+void histogram_reset(Histogram *h) {
+   for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      atomic_store_explicit(&h->counts[i], 0, memory_order_relaxed);
+   }
+   atomic_store(&h->total, 0);
+   atomic_store(&h->sum_ns, 0);
+   atomic_store(&h->max_ns, 0);
+}
+
+void histogram_merge(Histogram *into, Histogram *from) {
+   for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      counter_add(&into->counts[i], atomic_load_explicit(&from->counts[i], memory_order_relaxed));
+   }
+   counter_add(&into->total, atomic_load(&from->total));
+   counter_add(&into->sum_ns, atomic_load(&from->sum_ns));
+   counter_max(&into->max_ns, atomic_load(&from->max_ns));
+}
@@ -0,0 +1,36 @@
+#ifndef RBUS_HISTOGRAM_H
+#define RBUS_HISTOGRAM_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Log-linear latency histogram in the style of HdrHistogram: every power of two
+// is split into HISTOGRAM_SUB_COUNT linear buckets, giving ~12% precision from
+// 1 ns up to 2^HISTOGRAM_MAX_MAGNITUDE ns (~68 s) in a fixed array of counters.
+// Shared by the server and the benchmark tools. Counters are atomic, so one
+// thread may read while others record.
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_MAGNITUDE 36
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_COUNT * (HISTOGRAM_MAX_MAGNITUDE - HISTOGRAM_SUB_BITS + 2))
+
+typedef struct {
+   atomic_uint_fast64_t counts[HISTOGRAM_BUCKETS];
+   atomic_uint_fast64_t total;
+   atomic_uint_fast64_t sum_ns;
+   atomic_uint_fast64_t max_ns;
+} Histogram;
+
+void histogram_record(Histogram *h, uint64_t value_ns);
+
+// Value at quantile q (0..1), reported as the bucket's highest value
+uint64_t histogram_percentile(Histogram *h, double q);
+
+// Add the counts of from to into
+void histogram_merge(Histogram *into, Histogram *from);
+
+// Clear every counter. Safe to run while other threads record, though values
+// recorded during the reset may be partly kept.
+void histogram_reset(Histogram *h);
+
+#endif
@@ -0,0 +1,131 @@
+// Interning table for path and event names: a chained hash table of reference
+// counted entries, with the name stored inline after each entry.
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rbus_intern.h"
+
+#define INTERN_INITIAL_BUCKETS 256
+
+typedef struct InternEntry {
+   struct InternEntry *next;
+   uint32_t hash;
+   unsigned int refs;
+   char name[];
+} InternEntry;
+
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+static InternEntry **buckets = NULL;
+static size_t bucket_count = 0;
+static size_t entry_count = 0;
+
+static InternEntry *entry_of(const char *name) {
+   return (InternEntry *)(name - offsetof(InternEntry, name));
+}
+
+uint32_t intern_hash(const char *name) {
+   uint32_t hash = 2166136261u;
+   for (const unsigned char *p = (const unsigned char *)name; p && *p; p++) {
+      hash = (hash ^ *p) * 16777619u;
+   }
+   return hash;
+}
+
+// Find an entry (intern_lock held)
+static InternEntry *lookup(const char *name, uint32_t hash) {
+   if (!buckets) {
+      return NULL;
+   }
+   for (InternEntry *e = buckets[hash & (bucket_count - 1)]; e; e = e->next) {
+      if (e->hash == hash && strcmp(e->name, name) == 0) {
+         return e;
+      }
+   }
+   return NULL;
+}
+
+// Double the bucket array once entries outnumber buckets (intern_lock held).
+// Failing to grow only makes chains longer.
+static void grow(void) {
+   size_t count = bucket_count ? bucket_count * 2 : INTERN_INITIAL_BUCKETS;
+   InternEntry **grown = calloc(count, sizeof(InternEntry *));
+   if (!grown) {
+      return;
+   }
+   for (size_t i = 0; i < bucket_count; i++) {
+      InternEntry *e = buckets[i];
+      while (e) {
+         InternEntry *next = e->next;
+         e->next = grown[e->hash & (count - 1)];
+         grown[e->hash & (count - 1)] = e;
+         e = next;
+      }
+   }
+   free(buckets);
+   buckets = grown;
+   bucket_count = count;
+}
+
+const char *intern(const char *name) {
+   uint32_t hash = intern_hash(name);
+   pthread_mutex_lock(&intern_lock);
+   InternEntry *e = lookup(name, hash);
+   if (e) {
+      e->refs++;
+      pthread_mutex_unlock(&intern_lock);
+      return e->name;
+   }
+
+   if (entry_count >= bucket_count) {
+      grow();
+   }
+   size_t len = strlen(name);
+   e = buckets ? malloc(sizeof(InternEntry) + len + 1) : NULL;
+   if (!e) {
+      pthread_mutex_unlock(&intern_lock);
+      return NULL;
+   }
+   memcpy(e->name, name, len + 1);
+   e->hash = hash;
+   e->refs = 1;
+   e->next = buckets[hash & (bucket_count - 1)];
+   buckets[hash & (bucket_count - 1)] = e;
+   entry_count++;
+   pthread_mutex_unlock(&intern_lock);
+   return e->name;
+}
+
+const char *intern_find(const char *name) {
+   uint32_t hash = intern_hash(name);
+   pthread_mutex_lock(&intern_lock);
+   InternEntry *e = lookup(name, hash);
+   pthread_mutex_unlock(&intern_lock);
+   return e ? e->name : NULL;
+}
+
+void intern_release(const char *name) {
+   if (!name) {
+      return;
+   }
+   InternEntry *e = entry_of(name);
+   pthread_mutex_lock(&intern_lock);
+   if (--e->refs == 0) {
+      for (InternEntry **p = &buckets[e->hash & (bucket_count - 1)]; *p; p = &(*p)->next) {
+         if (*p == e) {
+            *p = e->next;
+            break;
+         }
+      }
+      entry_count--;
+      free(e);
+   }
+   pthread_mutex_unlock(&intern_lock);
+}
+
+size_t intern_count(void) {
+   pthread_mutex_lock(&intern_lock);
+   size_t count = entry_count;
+   pthread_mutex_unlock(&intern_lock);
+   return count;
+}
@@ -0,0 +1,29 @@
+#ifndef RBUS_INTERN_H
+#define RBUS_INTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Interned path and event names. Every distinct name is stored once, so two
+// interned names are equal exactly when their pointers are. Names are reference
+// counted. All functions are thread safe; the table has its own lock and never
+// calls out while holding it.
+
+// FNV-1a hash of a name, as used by the table
+uint32_t intern_hash(const char *name);
+
+// Return the interned copy of name, adding a reference. NULL on failure.
+const char *intern(const char *name);
+
+// Return the interned copy of name without adding a reference, or NULL if it
+// is not interned. The result is only meaningful while its holders keep their
+// references, e.g. under the lock that guards them.
+const char *intern_find(const char *name);
+
+// Drop a reference taken by intern; the copy is freed with the last one
+void intern_release(const char *name);
+
+// Number of distinct names interned
+size_t intern_count(void);
+
+#endif
@@ -0,0 +1,311 @@
+// Conversions between rbus values and JSON, and JSON-RPC message builders.
+// These are the per-message hot paths, kept apart from the server so they can
+// be benchmarked on their own (see bench_conversions.c).
+#include <string.h>
+#include <stdlib.h>
+
+#include "rbus_json.h"
+
+// Byte arrays up to this size are converted without a temporary allocation
+#define BYTES_STACK_LEN 256
+
+// Convert rbusValue_t to json_t
+json_t *rbus_value_to_json(rbusValue_t value) {
+   if (!value) {
+      return json_null();
+   }
+
+   rbusValueType_t type = rbusValue_GetType(value);
+
+   switch (type) {
+   case RBUS_BOOLEAN:
+      return json_boolean(rbusValue_GetBoolean(value));
+
+   case RBUS_CHAR:
+      return json_integer(rbusValue_GetChar(value));
+
+   case RBUS_BYTE:
+      return json_integer(rbusValue_GetByte(value));
+
+   case RBUS_INT8:
+   case RBUS_INT16:
+   case RBUS_INT32:
+   case RBUS_INT64:
+      return json_integer(rbusValue_GetInt64(value));
+
+   case RBUS_UINT8:
+   case RBUS_UINT16:
+   case RBUS_UINT32:
+   case RBUS_UINT64:
+      return json_integer(rbusValue_GetUInt64(value));
+
+   case RBUS_SINGLE:
+   case RBUS_DOUBLE:
+      return json_real(rbusValue_GetDouble(value));
+
+   case RBUS_STRING: {
+      const char *str = rbusValue_GetString(value, NULL);
+      return str ? json_string(str) : json_null();
+   }
+
+   case RBUS_DATETIME: {
+      const rbusDateTime_t *time_val = rbusValue_GetTime(value);
+      if (time_val) {
+         char time_str[32];
+         int len = snprintf(time_str, sizeof(time_str),
+            "%04d-%02d-%02dT%02d:%02d:%02d%s%02d:%02d",
+            time_val->m_time.tm_year + 1900,
+            time_val->m_time.tm_mon + 1,
+            time_val->m_time.tm_mday,
+            time_val->m_time.tm_hour,
+            time_val->m_time.tm_min,
+            time_val->m_time.tm_sec,
+            time_val->m_tz.m_isWest ? "-" : "+",
+            time_val->m_tz.m_tzhour,
+            time_val->m_tz.m_tzmin);
+         if (len >= (int)sizeof(time_str) || len < 0) {
+            return json_null();
+         }
+         return json_string(time_str);
+      }
+      return json_null();
+   }
+
+   case RBUS_BYTES: {
+      int len;
+      const uint8_t *bytes = rbusValue_GetBytes(value, &len);
+      if (bytes && len > 0) {
+         json_t *array = json_array();
+         for (int i = 0; i < len; i++) {
+            json_array_append_new(array, json_integer(bytes[i]));
+         }
+         return array;
+      }
+      return json_null();
+   }
+
+   case RBUS_PROPERTY:
+   case RBUS_OBJECT: {
+      json_t *object = json_object();
+      rbusObject_t obj = rbusValue_GetObject(value);
+      if (!obj) {
+         json_decref(object);
+         return json_null();
+      }
+      rbusProperty_t prop = rbusObject_GetProperties(obj);
+      while (prop) {
+         const char *key = rbusProperty_GetName(prop);
+         rbusValue_t val = rbusProperty_GetValue(prop);
+         if (key && val) {
+            json_t *json_value = rbus_value_to_json(val);
+            json_object_set_new(object, key, json_value);
+         }
+         prop = rbusProperty_GetNext(prop);
+      }
+      return object;
+   }
+
+   case RBUS_NONE:
+   default:
+      return json_null();
+   }
+}
+
+// Convert json_t to rbusValue_t
+rbusValue_t json_to_rbus_value(json_t *json) {
+   if (!json) {
+      return NULL;
+   }
+
+   rbusValue_t value = rbusValue_Init(NULL);
+
+   if (json_is_boolean(json)) {
+      rbusValue_SetBoolean(value, json_is_true(json));
+   } else if (json_is_integer(json)) {
+      rbusValue_SetInt64(value, json_integer_value(json));
+   } else if (json_is_real(json)) {
+      rbusValue_SetDouble(value, json_real_value(json));
+   } else if (json_is_string(json)) {
+      rbusValue_SetString(value, json_string_value(json));
+   } else if (json_is_array(json)) {
+      size_t len = json_array_size(json);
+      uint8_t stack_bytes[BYTES_STACK_LEN];
+      uint8_t *bytes = len <= sizeof(stack_bytes) ? stack_bytes : malloc(len);
+      if (!bytes) {
+         rbusValue_Release(value);
+         return NULL;
+      }
+      for (size_t i = 0; i < len; i++) {
+         json_t *item = json_array_get(json, i);
+         if (json_is_integer(item)) {
+            bytes[i] = (uint8_t)json_integer_value(item);
+         } else {
+            if (bytes != stack_bytes) {
+               free(bytes);
+            }
+            rbusValue_Release(value);
+            return NULL;
+         }
+      }
+      rbusValue_SetBytes(value, bytes, len);
+      if (bytes != stack_bytes) {
+         free(bytes);
+      }
+   } else if (json_is_object(json)) {
+      rbusObject_t obj = rbusObject_Init(NULL, NULL);
+      json_t *iter;
+      const char *key;
+      json_object_foreach(json, key, iter) {
+         rbusValue_t prop_value = json_to_rbus_value(iter);
+         if (prop_value) {
+            rbusObject_SetValue(obj, key, prop_value);
+            rbusValue_Release(prop_value);
+         }
+      }
+      rbusValue_SetObject(value, obj);
+      rbusObject_Release(obj);
+   } else {
+      rbusValue_Release(value);
+      return NULL;
+   }
+
+   return value;
+}
+
+// Split a comma-separated path list in place, trimming spaces and skipping
+// empty entries. Returns the number of paths stored, at most max_paths.
+static int split_paths(char *list, const char **paths, int max_paths) {
+   int count = 0;
+   char *p = list;
+   while (*p && count < max_paths) {
+      char *start = p;
+      while (*p && *p != ',') p++;
+      char *end = p;
+      if (*p) {
+         *p++ = '\0';
+      }
+      while (*start == ' ') start++;
+      while (end > start && end[-1] == ' ') {
+         *--end = '\0';
+      }
+      if (*start) {
+         paths[count++] = start;
+      }
+   }
+   return count;
+}
+
+int path_list_init(PathList *list, json_t *path) {
+   list->paths = list->inline_paths;
+   list->count = 0;
+   list->buffer = list->inline_buffer;
+
+   int max_paths;
+   if (json_is_array(path)) {
+      max_paths = (int)json_array_size(path);
+   } else if (json_is_string(path)) {
+      max_paths = 1;
+      for (const char *p = json_string_value(path); *p; p++) {
+         if (*p == ',') max_paths++;
+      }
+   } else {
+      return -1;
+   }
+   if (max_paths > PATH_LIST_INLINE) {
+      list->paths = malloc(max_paths * sizeof(char *));
+      if (!list->paths) {
+         list->paths = list->inline_paths;
+         return -1;
+      }
+   }
+
+   if (json_is_array(path)) {
+      // Already split; the paths point into the array's strings
+      size_t index;
+      json_t *item;
+      json_array_foreach(path, index, item) {
+         const char *name = json_string_value(item);
+         if (!name || !*name) {
+            return -1;
+         }
+         list->paths[list->count++] = name;
+      }
+   } else {
+      size_t len = json_string_length(path);
+      if (len >= sizeof(list->inline_buffer)) {
+         list->buffer = malloc(len + 1);
+         if (!list->buffer) {
+            list->buffer = list->inline_buffer;
+            return -1;
+         }
+      }
+      memcpy(list->buffer, json_string_value(path), len + 1);
+      list->count = split_paths(list->buffer, list->paths, max_paths);
+   }
+   return list->count > 0 ? 0 : -1;
+}
+
+void path_list_free(PathList *list) {
+   if (list->paths != list->inline_paths) {
+      free(list->paths);
+      list->paths = list->inline_paths;
+   }
+   if (list->buffer != list->inline_buffer) {
+      free(list->buffer);
+      list->buffer = list->inline_buffer;
+   }
+   list->count = 0;
+}
+
+// Map an rbus event type to its notification name
+const char *event_type_to_string(rbusEventType_t type) {
+   switch (type) {
+   case RBUS_EVENT_VALUE_CHANGED: return "value_changed";
+   case RBUS_EVENT_OBJECT_CREATED: return "object_created";
+   case RBUS_EVENT_OBJECT_DELETED: return "object_deleted";
+   case RBUS_EVENT_GENERAL: return "general";
+   case RBUS_EVENT_INITIAL_VALUE: return "initial_value";
+   case RBUS_EVENT_INTERVAL: return "interval";
+   case RBUS_EVENT_DURATION_COMPLETE: return "duration_complete";
+   default: return "unknown";
+   }
+}
+
+// Build rbus_event params for an event
+json_t *create_event_params(rbusEvent_t const *event, rbusValue_t value) {
+   json_t *params = json_object();
+   json_object_set_new(params, "eventName", json_string(event->name));
+   json_object_set_new(params, "type", json_string(event_type_to_string(event->type)));
+   json_object_set_new(params, "data", event->data ? rbus_value_to_json(value) : json_null());
+   return params;
+}
+
+// JSON-RPC messages
+json_t *create_error_response(int code, const char *message, json_t *id) {
+   json_t *response = json_object();
+   json_object_set_new(response, "jsonrpc", json_string("2.0"));
+
+   json_t *error = json_object();
+   json_object_set_new(error, "code", json_integer(code));
+   json_object_set_new(error, "message", json_string(message));
+   json_object_set_new(response, "error", error);
+
+   json_object_set_new(response, "id", id ? json_incref(id) : json_null());
+   return response;
+}
+
+json_t *create_notification(const char *method, json_t *params) {
+   json_t *notification = json_object();
+   json_object_set_new(notification, "jsonrpc", json_string("2.0"));
+   json_object_set_new(notification, "method", json_string(method));
+   json_object_set_new(notification, "params", params);
+   return notification;
+}
+
+json_t *create_success_response(json_t *result, json_t *id) {
+   json_t *response = json_object();
+   json_object_set_new(response, "jsonrpc", json_string("2.0"));
+   json_object_set_new(response, "result", result);
+   json_object_set_new(response, "id", id ? json_incref(id) : json_null());
+   return response;
+}
@@ -0,0 +1,42 @@
+#ifndef RBUS_JSON_H
+#define RBUS_JSON_H
+
+#include <jansson.h>
+#include <rbus.h>
+
+// Convert an rbus value to JSON. Returns json_null() for NULL or unsupported values.
+json_t *rbus_value_to_json(rbusValue_t value);
+
+// Convert JSON to a new rbus value, or NULL if it has no rbus equivalent.
+// Arrays of integers become bytes, objects become rbus objects.
+rbusValue_t json_to_rbus_value(json_t *json);
+
+// Paths of an rbus_get, from a comma-separated string or an array of strings.
+// Typical requests fit the inline storage, so building one does not allocate.
+#define PATH_LIST_INLINE 16
+typedef struct {
+   const char **paths;    // count entries, pointing into buffer or the JSON
+   int count;
+   char *buffer;          // Split copy of a comma-separated string
+   const char *inline_paths[PATH_LIST_INLINE];
+   char inline_buffer[512];
+} PathList;
+
+// Fill list from path. Returns -1 if path is not a string or an array of
+// non-empty strings, or holds no paths; free the list either way. The list
+// borrows from path, which must outlive it.
+int path_list_init(PathList *list, json_t *path);
+void path_list_free(PathList *list);
+
+// Notification name of an rbus event type, e.g. "value_changed"
+const char *event_type_to_string(rbusEventType_t type);
+
+// Build rbus_event params for an event whose value is value
+json_t *create_event_params(rbusEvent_t const *event, rbusValue_t value);
+
+// JSON-RPC messages. These take ownership of result and params; id is borrowed.
+json_t *create_error_response(int code, const char *message, json_t *id);
+json_t *create_notification(const char *method, json_t *params);
+json_t *create_success_response(json_t *result, json_t *id);
+
+#endif
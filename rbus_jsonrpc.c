@@ -5,266 +5,792 @@
 #include <stdio.h>
 #include <rbus.h>
 #include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rbus_json.h"
+#include "rbus_capture.h"
+#include "rbus_arena.h"
+#include "rbus_intern.h"
+#include "rbus_histogram.h"
 
 // Global rbus handle
 static rbusHandle_t g_rbusHandle = NULL;
 
+// Global lws context, used to wake the service loop from the rbus event thread
+static struct lws_context *g_context = NULL;
+
 static volatile sig_atomic_t shutdown_flag = 0;
-static json_t *create_error_response(int code, const char *message, json_t *id);
+static volatile sig_atomic_t dump_flag = 0;
+
+// rbus delivers events on its own thread, so event_handler only queues
+// notifications and the lws service thread writes them out. This lock protects
+// the connection and session lists, the per-connection event queues, the
+// session replay buffers and the subscription table.
+static pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define MAX_PENDING_EVENTS 1024
+#define DEFAULT_BATCH_MAX_EVENTS 64
+#define DEFAULT_BATCH_MAX_DELAY_MS 5
+#define DEFAULT_SESSION_GRACE_SECS 30
+#define DEFAULT_REPLAY_BUFFER_SIZE 256
+#define SESSION_ID_BYTES 16
+#define SNAPSHOT_TIMEOUT_MS 1000
+#define DEFAULT_SLOW_REQUEST_MS 1000
+#define DEFAULT_SLOW_REQUEST_LOG_RATE 5
+#define DEFAULT_FLIGHT_RECORDER_SIZE 8192
+#define DEFAULT_CAPTURE_MAX_BYTES (256LL * 1024 * 1024)
+#define DEFAULT_REQUEST_ARENA_SIZE 16384
+#define DEFAULT_UNIX_SOCKET_MODE 0660
+
+// Session tuning, read from the config file
+static int session_grace_secs = DEFAULT_SESSION_GRACE_SECS;
+static int replay_buffer_size = DEFAULT_REPLAY_BUFFER_SIZE;
+
+// Slow-request log tuning, read from the config file
+static int slow_request_ms = DEFAULT_SLOW_REQUEST_MS;
+static int slow_request_log_rate = DEFAULT_SLOW_REQUEST_LOG_RATE;
+
+// Add the server's receive time to rbus_event params, read from the config file
+static bool event_timestamps = false;
+
+// Flight recorder tuning, read from the config file
+static int flight_recorder_size = DEFAULT_FLIGHT_RECORDER_SIZE;
+static char *flight_recorder_file = NULL;
+
+// Traffic capture, read from the config file. Off unless capture_file is set.
+static char *capture_file = NULL;
+static long long capture_max_bytes = DEFAULT_CAPTURE_MAX_BYTES;
+
+// Request parsing, handling and serialization allocate from this arena on the
+// service thread, which is reset after each response (0 size disables it)
+static int request_arena_size = DEFAULT_REQUEST_ARENA_SIZE;
+static Arena request_arena;
+
+// Unix domain socket listener, read from the config file. Off unless
+// unix_socket is set; with tcp_enabled false it is the only listener.
+static char *unix_socket = NULL;
+static mode_t unix_socket_mode = DEFAULT_UNIX_SOCKET_MODE;
+static bool tcp_enabled = true;
+
+// Raw TCP listener speaking newline-delimited JSON-RPC, read from the config
+// file. Off unless raw_tcp_port is set.
+static int raw_tcp_port = 0;
+#define RAW_MAX_LINE (1024 * 1024)
+
+struct Connection;
+
+// Delivery timestamps of a queued event, kept beside the connection's JSON
+// queues so stage latencies can be measured without touching event params
+typedef struct {
+   int64_t received_ns; // event_handler entry, 0 for replayed events
+   int64_t queued_ns;   // Appended to the connection queue
+} EventStamp;
+
+// FIFO of EventStamp, one per entry of the matching JSON queue
+typedef struct {
+   EventStamp *items;
+   size_t head;
+   size_t count;
+   size_t capacity;
+} StampQueue;
+
+// A session owns subscriptions and outlives its WebSocket for a grace period,
+// so a reconnecting client can resume and replay the events it missed
+typedef struct Session {
+   char id[SESSION_ID_BYTES * 2 + 1]; // Hex session id
+   struct Connection *conn;           // Attached connection, NULL while detached
+   uint64_t seq;                      // Sequence number of the last event
+   json_t **replay;                   // Ring buffer of recent event params
+   int replay_head;                   // Index of the oldest entry
+   int replay_count;                  // Number of entries in the ring
+   time_t expires;                    // When a detached session is dropped
+   struct Session *next;
+} Session;
+
+static Session *sessions = NULL;
+
+// Outbound message buffer, reused for every message written on a connection.
+// lws_write needs LWS_PRE writable bytes in front of the payload for framing.
+typedef struct {
+   unsigned char *data; // LWS_PRE bytes of headroom, then capacity bytes of payload
+   size_t capacity;
+} SendBuffer;
+
+#define SEND_BUFFER_INITIAL 4096
+#define SEND_BUFFER_MAX_KEPT (256 * 1024) // Larger buffers are freed after use
+
+// How a connection talks to its client
+typedef enum {
+   TRANSPORT_WEBSOCKET, // JSON-RPC requests and notifications in WebSocket messages
+   TRANSPORT_SSE,       // Read-only server-sent event stream (GET /events)
+   TRANSPORT_RAW        // Newline-delimited JSON-RPC on a raw TCP socket
+} Transport;
+
+// Per-connection state, stored in the lws per-session user data
+typedef struct Connection {
+   struct lws *wsi;         // WebSocket or HTTP instance
+   Transport transport;
+   unsigned long id;        // Connection number, for logs
+   Session *session;        // Session owning this connection's subscriptions
+   json_t *pending;         // Queued rbus_event notifications
+   json_t *batch;           // Event params waiting to be sent as one rbus_events notification
+   int batch_max_events;    // Flush the batch once it holds this many events
+   int batch_max_delay_ms;  // Flush the batch once its oldest event is this old
+   bool batch_due;          // Batch delay timer has fired
+   bool timer_armed;        // Batch delay timer is pending
+   StampQueue pending_stamps; // Delivery timestamps of pending entries
+   StampQueue batch_stamps;   // Delivery timestamps of batch entries
+   SendBuffer send;         // Responses and notifications are serialized here (lws thread)
+   char *input;             // Raw sockets: received bytes not handled yet, see raw_receive
+   size_t input_len;
+   size_t input_capacity;
+   bool rx_paused;          // Raw sockets: reading stopped until backed-up output drains
+   struct Connection *next;
+} Connection;
+
+static Connection *connections = NULL;
+
+// Server-side notification filters, for providers that do not honor rbus filters.
+// Both apply to value_changed events only.
+typedef struct {
+   double deadband;         // Minimum absolute change from the last forwarded value, 0 = off
+   double deadband_percent; // Minimum change as a percentage of the last forwarded value, 0 = off
+   int min_interval_ms;     // Minimum time between forwarded events, 0 = off
+} EventFilter;
+
+// A wildcard subscription such as Device.WiFi.AccessPoint.{i}.AssociatedDevice.{i}.
+// is expanded against the data model into ordinary subscription entries plus
+// table watches, which expand new rows and drop deleted ones. Wildcards are only
+// touched on the lws thread.
+typedef struct Wildcard {
+   char *pattern;    // Event name as given by the client
+   Session *session; // Owning session
+   bool batch;       // Deliver expanded events in rbus_events batches
+   int timeout;      // rbus subscribe retry timeout in seconds
+   EventFilter filter;
+   struct Wildcard *next;
+} Wildcard;
+
+static Wildcard *wildcards = NULL;
+
+// Table row change seen by a wildcard watch, expanded later on the lws thread
+typedef struct RowChange {
+   Wildcard *wildcard;
+   char *row;    // Row name, e.g. Device.WiFi.AccessPoint.3.
+   char *rest;   // Pattern below the row
+   bool created; // Row created (expand) or deleted (drop)
+   struct RowChange *next;
+} RowChange;
+
+static RowChange *row_changes = NULL;
+
+// Blocking rbus reads that would stall the lws thread run on the rbus worker
+// thread. Jobs and their results are passed under event_lock, and the lws
+// thread is woken to handle each result.
+typedef enum {
+   RBUS_JOB_SNAPSHOT,  // Read the value for a snapshot subscribe
+   RBUS_JOB_ROW_NAMES, // List a table's rows for a wildcard; each becomes a RowChange
+} RbusJobType;
+
+typedef struct RbusJob {
+   RbusJobType type;
+   const char *eventName; // Snapshot: interned; the entry is found by name and ticket
+   uint64_t ticket;
+   bool created;          // Snapshot: the subscribe created the entry, so a failed get removes it
+   json_t *result;        // Snapshot: rbus_get_value result, NULL if the entry was gone
+   Wildcard *wildcard;    // Row names: wildcard the rows are expanded for
+   char *table;           // Row names: table to list
+   char *rest;            // Row names: pattern below each row
+   struct RbusJob *next;
+} RbusJob;
+
+static RbusJob *rbus_jobs = NULL;      // Waiting for the worker, oldest first
+static RbusJob *rbus_jobs_done = NULL; // Run, waiting for the lws thread
+static pthread_cond_t rbus_job_ready = PTHREAD_COND_INITIALIZER;
+static pthread_t rbus_worker;
+static bool rbus_worker_stop = false;
+static uint64_t snapshot_tickets = 0;
+
+// Progress of a snapshot subscribe whose response is still owed
+typedef enum {
+   SNAPSHOT_NONE,
+   SNAPSHOT_WAITING,  // Waiting for the provider's initial value; value changes are older and dropped
+   SNAPSHOT_FETCHING, // The rbus worker reads the value with rbus_getExt; events are held until the response is queued
+} SnapshotState;
 
 // Structure to store subscription information
 typedef struct {
-   char *eventName; // Event name
-   struct lws *wsi; // WebSocket instance
+   const char *eventName; // Event name, interned so entries compare by pointer
+   uint32_t name_hash; // intern_hash of eventName, its bucket in the name index
+   int next_by_name;   // Next entry in the same name index bucket, -1 for none
+   Session *session;   // Owning session
+   bool batch;         // Deliver events in rbus_events batches
+   SnapshotState snapshot;
+   json_t *snapshot_id;  // Request id the owed subscribe response answers, NULL for a notification
+   int64_t snapshot_deadline_ms; // SNAPSHOT_WAITING: when to fall back to rbus_getExt
+   uint64_t snapshot_ticket; // SNAPSHOT_FETCHING: identifies the rbus worker job reading the value
+   json_t *held;         // Event params held back until the owed response is queued
+   size_t held_at_fetch; // Held events received before the get was issued, which its result includes
+   json_t *snapshot_value; // Value sent in an inexact snapshot; changes repeating it are dropped until an event is sent
+   Wildcard *wildcard; // Wildcard this entry was expanded from, NULL for direct subscriptions
+   char *rest;         // Table watches only: the wildcard pattern below each row
+   EventFilter filter; // Deadband / rate limit
+   bool has_last;      // last_value holds the last forwarded numeric value
+   double last_value;
+   int64_t last_sent_ms; // Monotonic time of the last forwarded event
+   json_t *trailing;     // Newest event held back by min_interval_ms, sent when the interval ends
+   int64_t trailing_received_ns;
+   bool trailing_numeric; // trailing_value holds the held event's numeric value
+   double trailing_value;
 } Subscription;
 
-#define MAX_SUBSCRIPTIONS 100
-static Subscription subscriptions[MAX_SUBSCRIPTIONS];
+// Options for add_subscription, parsed from rbusEvent_Subscribe params
+typedef struct {
+   int timeout;   // rbus subscribe retry timeout in seconds
+   bool batch;    // Deliver events in rbus_events batches
+   bool snapshot; // Return current values atomically with the subscription
+   json_t *id;    // With snapshot: the request id, answered once the snapshot is taken; NULL for none
+   EventFilter filter;
+} SubscribeOptions;
+
+#define MAX_SUBSCRIPTIONS 16384
+static Subscription *subscriptions = NULL;
 static int subscription_count = 0;
+static int subscription_capacity = 0;
 
-// Signal handler for SIGTERM
-static void handle_sigterm(int sig) {
-   (void)sig; // Suppress unused parameter warning
-   shutdown_flag = 1;
+// Index of the subscription table by event name: each bucket chains the entries
+// whose name hashes to it, so lookups and event fan-out only visit entries that
+// may share the name. One bucket per table slot (event_lock held).
+static int *name_buckets = NULL;
+
+static int *name_bucket(uint32_t hash) {
+   return &name_buckets[hash & (subscription_capacity - 1)];
 }
 
-// Convert rbusValue_t to json_t
-static json_t *rbus_value_to_json(rbusValue_t value) {
-   if (!value) {
-      return json_null();
+// First entry of the chain a name hashes to, or -1
+static int name_chain(uint32_t hash) {
+   return name_buckets ? *name_bucket(hash) : -1;
+}
+
+static void index_link(int i) {
+   int *head = name_bucket(subscriptions[i].name_hash);
+   subscriptions[i].next_by_name = *head;
+   *head = i;
+}
+
+static void index_unlink(int i) {
+   int *p = name_bucket(subscriptions[i].name_hash);
+   while (*p != i) {
+      p = &subscriptions[*p].next_by_name;
    }
+   *p = subscriptions[i].next_by_name;
+}
 
-   rbusValueType_t type = rbusValue_GetType(value);
+// Remove entry i from the table, moving the last entry into its slot
+static void remove_entry_at(int i) {
+   int last = --subscription_count;
+   index_unlink(i);
+   if (i != last) {
+      index_unlink(last);
+      subscriptions[i] = subscriptions[last];
+      index_link(i);
+   }
+}
 
-   switch (type) {
-   case RBUS_BOOLEAN:
-      return json_boolean(rbusValue_GetBoolean(value));
+// Earliest time a held trailing event is due (event_lock held), 0 = none, and
+// the timer that sends it (lws thread)
+static int64_t trailing_due_ms = 0;
+static int64_t trailing_scheduled_ms = 0;
+static lws_sorted_usec_list_t trailing_sul;
+
+// JSON-RPC method handlers, defined below
+typedef json_t *(*MethodHandler)(json_t *params, json_t *id, struct lws *wsi);
+static json_t *handle_rbus_get(json_t *params, json_t *id, struct lws *wsi);
+static json_t *handle_rbus_set(json_t *params, json_t *id, struct lws *wsi);
+static json_t *handle_rbus_event_subscribe(json_t *params, json_t *id, struct lws *wsi);
+static json_t *handle_rbus_event_unsubscribe(json_t *params, json_t *id, struct lws *wsi);
+static json_t *handle_session_info(json_t *params, json_t *id, struct lws *wsi);
+static json_t *handle_session_resume(json_t *params, json_t *id, struct lws *wsi);
+static json_t *handle_server_stats(json_t *params, json_t *id, struct lws *wsi);
+static json_t *handle_flight_recorder(json_t *params, json_t *id, struct lws *wsi);
+
+// The handler changes state that outlives the request (sessions, subscriptions),
+// so it allocates from the heap rather than the request arena
+#define METHOD_HEAP 0x1
+// The handler works on the caller's WebSocket session, so the method is not
+// available to transports without one (HTTP POST)
+#define METHOD_SESSION 0x2
 
-   case RBUS_CHAR:
-      return json_integer(rbusValue_GetChar(value));
+typedef struct {
+   const char *name;
+   MethodHandler handler;
+   unsigned int flags; // METHOD_*
+} MethodDescriptor;
+
+// Supported methods. To add one, add its descriptor here; dispatch, the
+// request metrics, server_stats and the flight recorder all follow this table.
+static const MethodDescriptor methods[] = {
+   { "rbus_get", handle_rbus_get, 0 },
+   { "rbus_set", handle_rbus_set, 0 },
+   { "rbusEvent_Subscribe", handle_rbus_event_subscribe, METHOD_HEAP | METHOD_SESSION },
+   { "rbusEvent_Unsubscribe", handle_rbus_event_unsubscribe, METHOD_HEAP | METHOD_SESSION },
+   { "session_info", handle_session_info, METHOD_SESSION },
+   { "session_resume", handle_session_resume, METHOD_HEAP | METHOD_SESSION },
+   { "server_stats", handle_server_stats, 0 },
+   { "flight_recorder", handle_flight_recorder, 0 },
+};
+#define METHOD_COUNT (sizeof(methods) / sizeof(methods[0]))
+
+// Methods counted on /metrics: the table above, then "other" for unknown names
+#define METRIC_METHOD_COUNT (METHOD_COUNT + 1)
+
+// Dispatch hash table, built at startup with a seed that gives every method
+// its own slot, so a lookup is one hash and one string compare
+#define METHOD_SLOTS_MAX 256
+static uint8_t method_slots[METHOD_SLOTS_MAX]; // Index into methods + 1, 0 = empty
+static uint32_t method_slot_mask = 0;
+static uint32_t method_seed = 0;
+
+static const int metric_error_codes[] = { -32700, -32600, -32601, -32602, -32000 };
+#define METRIC_ERROR_CODE_COUNT (sizeof(metric_error_codes) / sizeof(metric_error_codes[0]))
+
+// rbus operations timed for /metrics
+typedef enum {
+   RBUS_OP_GET,
+   RBUS_OP_SET,
+   RBUS_OP_SUBSCRIBE,
+   RBUS_OP_UNSUBSCRIBE,
+   RBUS_OP_GET_ROW_NAMES,
+   RBUS_OP_COUNT
+} RbusOp;
+
+static const char *const rbus_op_names[RBUS_OP_COUNT] = {
+   "get", "set", "subscribe", "unsubscribe", "get_row_names"
+};
 
-   case RBUS_BYTE:
-      return json_integer(rbusValue_GetByte(value));
+// Upper bounds of the rbus call latency histogram buckets, in seconds
+static const double rbus_latency_buckets[] = { 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5 };
+#define RBUS_LATENCY_BUCKET_COUNT (sizeof(rbus_latency_buckets) / sizeof(rbus_latency_buckets[0]))
+
+// Counters exported on /metrics, updated from both the lws and rbus threads
+static struct {
+   atomic_uint_fast64_t requests[METRIC_METHOD_COUNT];
+   atomic_uint_fast64_t errors[METRIC_ERROR_CODE_COUNT + 1];
+   atomic_int connections;
+   atomic_uint_fast64_t events_received;
+   atomic_uint_fast64_t events_sent;
+   atomic_uint_fast64_t events_dropped;
+   atomic_uint_fast64_t bytes_sent;
+   atomic_uint_fast64_t slow_requests;
+   atomic_uint_fast64_t rbus_calls[RBUS_OP_COUNT][RBUS_LATENCY_BUCKET_COUNT + 1];
+   atomic_uint_fast64_t rbus_call_ns[RBUS_OP_COUNT];
+} metrics;
+
+static inline void metric_add(atomic_uint_fast64_t *counter, uint64_t n) {
+   atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
 
-   case RBUS_INT8:
-   case RBUS_INT16:
-   case RBUS_INT32:
-   case RBUS_INT64:
-      return json_integer(rbusValue_GetInt64(value));
+// Monotonic clock in nanoseconds
+static int64_t monotonic_ns(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-   case RBUS_UINT8:
-   case RBUS_UINT16:
-   case RBUS_UINT32:
-   case RBUS_UINT64:
-      return json_integer(rbusValue_GetUInt64(value));
+// Request handling phases timed per method and path prefix
+typedef enum {
+   STATS_PARSE,
+   STATS_RBUS,
+   STATS_CONVERT,
+   STATS_SERIALIZE,
+   STATS_WRITE,
+   STATS_TOTAL,
+   STATS_PHASE_COUNT
+} StatsPhase;
+
+static const char *const stats_phase_names[STATS_PHASE_COUNT] = {
+   "parse", "rbus", "convert", "serialize", "write", "total"
+};
 
-   case RBUS_SINGLE:
-   case RBUS_DOUBLE:
-      return json_real(rbusValue_GetDouble(value));
-
-   case RBUS_STRING: {
-      const char *str = rbusValue_GetString(value, NULL);
-      return str ? json_string(str) : json_null();
-   }
-
-   case RBUS_DATETIME: {
-      const rbusDateTime_t *time_val = rbusValue_GetTime(value);
-      if (time_val) {
-         char time_str[32];
-         int len = snprintf(time_str, sizeof(time_str),
-            "%04d-%02d-%02dT%02d:%02d:%02d%s%02d:%02d",
-            time_val->m_time.tm_year + 1900,
-            time_val->m_time.tm_mon + 1,
-            time_val->m_time.tm_mday,
-            time_val->m_time.tm_hour,
-            time_val->m_time.tm_min,
-            time_val->m_time.tm_sec,
-            time_val->m_tz.m_isWest ? "-" : "+",
-            time_val->m_tz.m_tzhour,
-            time_val->m_tz.m_tzmin);
-         if (len >= (int)sizeof(time_str) || len < 0) {
-            return json_null();
-         }
-         return json_string(time_str);
-      }
-      return json_null();
+typedef struct {
+   Histogram phases[STATS_PHASE_COUNT];
+} StatsCell;
+
+// Path prefixes requests are bucketed by, read from the config file. Requests
+// matching none of them fall into an extra "other" bucket.
+#define MAX_STATS_PREFIXES 16
+static char *stats_prefixes[MAX_STATS_PREFIXES];
+static int stats_prefix_count = 0;
+
+// Histograms per method and prefix, allocated on first use
+static _Atomic(StatsCell *) stats_cells[METRIC_METHOD_COUNT][MAX_STATS_PREFIXES + 1];
+
+// Timing of the request being handled on this thread
+typedef struct {
+   int method;              // Index into methods (METHOD_COUNT for unknown), -1 until dispatched
+   const char *method_name; // Method as sent by the client
+   const char *path;        // Path(s) or event name, for prefix bucketing
+   unsigned long conn_id;   // Connection the request arrived on
+   rbusError_t rbus_error;  // First failing rbus call, if any
+   int64_t phase_ns[STATS_PHASE_COUNT];
+} RequestTrace;
+
+static _Thread_local RequestTrace *current_trace = NULL;
+
+// A batch element is being handled (lws thread). There a request without an id
+// is a notification; sent on its own it is answered with a null id.
+static bool in_batch = false;
+
+// Add time since start_ns to a phase of the current request
+static void trace_phase(StatsPhase phase, int64_t start_ns) {
+   if (current_trace) {
+      current_trace->phase_ns[phase] += monotonic_ns() - start_ns;
    }
+}
 
-   case RBUS_BYTES: {
-      int len;
-      const uint8_t *bytes = rbusValue_GetBytes(value, &len);
-      if (bytes && len > 0) {
-         json_t *array = json_array();
-         for (int i = 0; i < len; i++) {
-            json_array_append_new(array, json_integer(bytes[i]));
-         }
-         return array;
-      }
-      return json_null();
-   }
-
-   case RBUS_PROPERTY:
-   case RBUS_OBJECT: {
-      json_t *object = json_object();
-      rbusObject_t obj = rbusValue_GetObject(value);
-      if (!obj) {
-         json_decref(object);
-         return json_null();
-      }
-      rbusProperty_t prop = rbusObject_GetProperties(obj);
-      while (prop) {
-         const char *key = rbusProperty_GetName(prop);
-         rbusValue_t val = rbusProperty_GetValue(prop);
-         if (key && val) {
-            json_t *json_value = rbus_value_to_json(val);
-            json_object_set_new(object, key, json_value);
-         }
-         prop = rbusProperty_GetNext(prop);
-      }
-      return object;
+// Event delivery stages: rbus callback to enqueue, time spent queued, then
+// serialization and WebSocket write of the notification carrying the event
+typedef enum {
+   EVENT_STAGE_HANDLER,
+   EVENT_STAGE_QUEUE,
+   EVENT_STAGE_SERIALIZE,
+   EVENT_STAGE_WRITE,
+   EVENT_STAGE_TOTAL,
+   EVENT_STAGE_COUNT
+} EventStage;
+
+static const char *const event_stage_names[EVENT_STAGE_COUNT] = {
+   "handler", "queue", "serialize", "write", "total"
+};
+
+static Histogram event_stages[EVENT_STAGE_COUNT];
+
+// Remember the first rbus failure of the current request for the slow-request log
+static void trace_rbus_error(rbusError_t err) {
+   if (current_trace && err != RBUS_ERROR_SUCCESS && current_trace->rbus_error == RBUS_ERROR_SUCCESS) {
+      current_trace->rbus_error = err;
    }
+}
 
-   case RBUS_NONE:
-   default:
-      return json_null();
+// Log a request whose total time exceeded slow_request_ms. Logging is limited
+// to slow_request_log_rate lines per second; the number of lines suppressed is
+// reported with the next line that gets through.
+static void log_slow_request(const RequestTrace *trace) {
+   static time_t window = 0;
+   static int logged = 0;
+   static unsigned long suppressed = 0;
+
+   if (slow_request_ms <= 0 || trace->phase_ns[STATS_TOTAL] < (int64_t)slow_request_ms * 1000000) {
+      return;
+   }
+   metric_add(&metrics.slow_requests, 1);
+
+   time_t now = time(NULL);
+   if (now != window) {
+      window = now;
+      logged = 0;
    }
+   if (logged >= slow_request_log_rate) {
+      suppressed++;
+      return;
+   }
+   logged++;
+
+   lwsl_warn("Slow request: conn=%lu method=%s paths=%.256s total=%.3fms parse=%.3fms rbus=%.3fms "
+      "convert=%.3fms serialize=%.3fms write=%.3fms rbus_error=%s suppressed=%lu\n",
+      trace->conn_id, trace->method_name ? trace->method_name : "-", trace->path ? trace->path : "-",
+      trace->phase_ns[STATS_TOTAL] / 1e6, trace->phase_ns[STATS_PARSE] / 1e6, trace->phase_ns[STATS_RBUS] / 1e6,
+      trace->phase_ns[STATS_CONVERT] / 1e6, trace->phase_ns[STATS_SERIALIZE] / 1e6, trace->phase_ns[STATS_WRITE] / 1e6,
+      trace->rbus_error == RBUS_ERROR_SUCCESS ? "none" : rbusError_ToString(trace->rbus_error), suppressed);
+   suppressed = 0;
 }
 
-// Convert json_t to rbusValue_t
-static rbusValue_t json_to_rbus_value(json_t *json) {
-   if (!json) {
-      return NULL;
+// Flight recorder: a fixed ring of compact records of the most recent requests
+// and events, kept in memory so there is something to look at after an
+// incident. Writers claim a slot with one atomic increment and publish it with
+// a per-slot sequence number, so recording never takes a lock.
+typedef enum {
+   FLIGHT_REQUEST,
+   FLIGHT_EVENT
+} FlightKind;
+
+typedef struct {
+   atomic_uint_fast64_t seq; // Claim index + 1 once written, 0 while being written
+   int64_t time_ns;          // Monotonic time the operation finished
+   uint32_t conn_id;         // Connection for requests, 0 for events
+   uint32_t name_hash;       // FNV-1a hash of the paths or event name
+   uint32_t duration_us;
+   uint16_t kind;            // FlightKind
+   uint16_t code;            // Index into methods, or rbusEventType_t
+   int32_t status;           // JSON-RPC error code, or sessions an event was queued for
+} FlightRecord;
+
+static FlightRecord *flight_records = NULL;
+static size_t flight_mask = 0;
+static atomic_uint_fast64_t flight_next = 0;
+
+
+// Allocate the ring, rounding its size up to a power of two
+static int flight_recorder_init(void) {
+   if (flight_recorder_size <= 0) {
+      return 0;
+   }
+   size_t size = 1;
+   while (size < (size_t)flight_recorder_size) {
+      size <<= 1;
+   }
+   flight_records = calloc(size, sizeof(FlightRecord));
+   if (!flight_records) {
+      return -1;
    }
+   flight_mask = size - 1;
+   return 0;
+}
 
-   rbusValue_t value = rbusValue_Init(NULL);
-
-   if (json_is_boolean(json)) {
-      rbusValue_SetBoolean(value, json_is_true(json));
-   } else if (json_is_integer(json)) {
-      rbusValue_SetInt64(value, json_integer_value(json));
-   } else if (json_is_real(json)) {
-      rbusValue_SetDouble(value, json_real_value(json));
-   } else if (json_is_string(json)) {
-      rbusValue_SetString(value, json_string_value(json));
-   } else if (json_is_array(json)) {
-      size_t len = json_array_size(json);
-      uint8_t *bytes = malloc(len);
-      if (!bytes) {
-         rbusValue_Release(value);
-         return NULL;
-      }
-      for (size_t i = 0; i < len; i++) {
-         json_t *item = json_array_get(json, i);
-         if (json_is_integer(item)) {
-            bytes[i] = (uint8_t)json_integer_value(item);
-         } else {
-            free(bytes);
-            rbusValue_Release(value);
-            return NULL;
+static void flight_record(FlightKind kind, uint16_t code, uint32_t conn_id, const char *name,
+   int64_t start_ns, int64_t end_ns, int32_t status) {
+   if (!flight_records) {
+      return;
+   }
+   uint64_t index = atomic_fetch_add_explicit(&flight_next, 1, memory_order_relaxed);
+   FlightRecord *record = &flight_records[index & flight_mask];
+   atomic_store_explicit(&record->seq, 0, memory_order_relaxed);
+   atomic_thread_fence(memory_order_release);
+   record->time_ns = end_ns;
+   record->conn_id = conn_id;
+   record->name_hash = intern_hash(name);
+   int64_t duration_us = (end_ns - start_ns) / 1000;
+   record->duration_us = duration_us > UINT32_MAX ? UINT32_MAX : (uint32_t)duration_us;
+   record->kind = (uint16_t)kind;
+   record->code = code;
+   record->status = status;
+   atomic_store_explicit(&record->seq, index + 1, memory_order_release);
+}
+
+// Copy the record claimed at index, if it is still in the ring and not being rewritten
+static bool flight_read(uint64_t index, FlightRecord *copy) {
+   FlightRecord *record = &flight_records[index & flight_mask];
+   if (atomic_load_explicit(&record->seq, memory_order_acquire) != index + 1) {
+      return false;
+   }
+   copy->time_ns = record->time_ns;
+   copy->conn_id = record->conn_id;
+   copy->name_hash = record->name_hash;
+   copy->duration_us = record->duration_us;
+   copy->kind = record->kind;
+   copy->code = record->code;
+   copy->status = record->status;
+   atomic_thread_fence(memory_order_acquire);
+   return atomic_load_explicit(&record->seq, memory_order_relaxed) == index + 1;
+}
+
+// Capture state, only touched from the lws service thread
+static FILE *capture_out = NULL;
+static int64_t capture_start_ns = 0;
+static long long capture_bytes = 0;
+
+// Open capture_file and write the header
+static int capture_open(void) {
+   capture_out = fopen(capture_file, "wb");
+   if (!capture_out) {
+      fprintf(stderr, "Warning: Cannot open capture file %s: %s\n", capture_file, strerror(errno));
+      return -1;
+   }
+   setvbuf(capture_out, NULL, _IOFBF, 1 << 16);
+   CaptureHeader header = { .version = CAPTURE_VERSION };
+   memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+   fwrite(&header, sizeof(header), 1, capture_out);
+   capture_start_ns = monotonic_ns();
+   capture_bytes = sizeof(header);
+   return 0;
+}
+
+// Append a record. Capture stops for good once capture_max_bytes is reached.
+static void capture_frame(CaptureType type, unsigned long conn_id, const void *data, size_t len) {
+   if (!capture_out) {
+      return;
+   }
+   if (capture_bytes + (long long)(sizeof(CaptureRecord) + len) > capture_max_bytes) {
+      lwsl_warn("Capture file reached %lld bytes, capture stopped\n", capture_bytes);
+      fclose(capture_out);
+      capture_out = NULL;
+      return;
+   }
+   CaptureRecord record = {
+      .time_ns = (uint64_t)(monotonic_ns() - capture_start_ns),
+      .conn_id = (uint32_t)conn_id,
+      .length = (uint32_t)len,
+      .type = (uint8_t)type
+   };
+   fwrite(&record, sizeof(record), 1, capture_out);
+   if (len > 0) {
+      fwrite(data, 1, len, capture_out);
+   }
+   capture_bytes += sizeof(record) + len;
+}
+
+// Bucket a path by the first configured prefix it starts with
+static int stats_prefix_index(const char *path) {
+   if (path) {
+      for (int i = 0; i < stats_prefix_count; i++) {
+         if (strncmp(path, stats_prefixes[i], strlen(stats_prefixes[i])) == 0) {
+            return i;
          }
       }
-      rbusValue_SetBytes(value, bytes, len);
-      free(bytes);
-   } else if (json_is_object(json)) {
-      rbusObject_t obj = rbusObject_Init(NULL, NULL);
-      json_t *iter;
-      const char *key;
-      json_object_foreach(json, key, iter) {
-         rbusValue_t prop_value = json_to_rbus_value(iter);
-         if (prop_value) {
-            rbusObject_SetValue(obj, key, prop_value);
-            rbusValue_Release(prop_value);
-         }
+   }
+   return stats_prefix_count;
+}
+
+// Record a finished request's phases in its method/prefix histograms
+static void record_request_trace(const RequestTrace *trace) {
+   if (trace->method < 0) {
+      return;
+   }
+
+   int prefix = stats_prefix_index(trace->path);
+   StatsCell *cell = atomic_load(&stats_cells[trace->method][prefix]);
+   if (!cell) {
+      StatsCell *created = calloc(1, sizeof(StatsCell));
+      if (!created) {
+         return;
+      }
+      if (atomic_compare_exchange_strong(&stats_cells[trace->method][prefix], &cell, created)) {
+         cell = created;
+      } else {
+         free(created);
       }
-      rbusValue_SetObject(value, obj);
-      rbusObject_Release(obj);
-   } else {
-      rbusValue_Release(value);
-      return NULL;
    }
 
-   return value;
+   for (int phase = 0; phase < STATS_PHASE_COUNT; phase++) {
+      if (phase == STATS_TOTAL || trace->phase_ns[phase] > 0) {
+         histogram_record(&cell->phases[phase], (uint64_t)trace->phase_ns[phase]);
+      }
+   }
 }
 
-// Parse comma-separated paths
-static char **parse_paths(const char *path_str, int *path_count) {
-   if (!path_str || !*path_str) {
-      *path_count = 0;
-      return NULL;
+// Record the latency of an rbus call started at start_ns
+static void record_rbus_call(RbusOp op, int64_t start_ns) {
+   int64_t elapsed_ns = monotonic_ns() - start_ns;
+   if (current_trace) {
+      current_trace->phase_ns[STATS_RBUS] += elapsed_ns;
    }
+   double elapsed = (double)elapsed_ns / 1e9;
+   size_t bucket = 0;
+   while (bucket < RBUS_LATENCY_BUCKET_COUNT && elapsed > rbus_latency_buckets[bucket]) {
+      bucket++;
+   }
+   metric_add(&metrics.rbus_calls[op][bucket], 1);
+   metric_add(&metrics.rbus_call_ns[op], (uint64_t)elapsed_ns);
+}
+
+static const char *method_name(size_t index) {
+   return index < METHOD_COUNT ? methods[index].name : "other";
+}
 
-   int count = 1;
-   const char *p = path_str;
-   while (*p) {
-      if (*p == ',') count++;
-      p++;
+static uint32_t method_hash(const char *name, uint32_t seed) {
+   uint32_t hash = 2166136261u ^ seed;
+   for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+      hash = (hash ^ *p) * 16777619u;
    }
+   return hash;
+}
 
-   char **paths = malloc(count * sizeof(char *));
-   if (!paths) {
-      *path_count = 0;
-      return NULL;
+// Find a seed and table size (at least four slots per method) under which no
+// two methods share a slot
+static int method_table_init(void) {
+   uint32_t slots = 4;
+   while (slots < 4 * METHOD_COUNT) {
+      slots *= 2;
+   }
+   for (; slots <= METHOD_SLOTS_MAX; slots *= 2) {
+      for (uint32_t seed = 1; seed <= 65536; seed++) {
+         memset(method_slots, 0, sizeof(method_slots));
+         size_t i = 0;
+         while (i < METHOD_COUNT) {
+            uint8_t *slot = &method_slots[method_hash(methods[i].name, seed) & (slots - 1)];
+            if (*slot) {
+               break;
+            }
+            *slot = (uint8_t)(i + 1);
+            i++;
+         }
+         if (i == METHOD_COUNT) {
+            method_slot_mask = slots - 1;
+            method_seed = seed;
+            return 0;
+         }
+      }
    }
+   return -1;
+}
 
-   char *path_copy = strdup(path_str);
-   if (!path_copy) {
-      free(paths);
-      *path_count = 0;
-      return NULL;
+static const MethodDescriptor *find_method(const char *name) {
+   uint8_t slot = method_slots[method_hash(name, method_seed) & method_slot_mask];
+   if (slot && strcmp(methods[slot - 1].name, name) == 0) {
+      return &methods[slot - 1];
    }
+   return NULL;
+}
 
-   int i = 0;
-   char *token = strtok(path_copy, ",");
-   while (token && i < count) {
-      while (*token == ' ') token++;
-      char *end = token + strlen(token) - 1;
-      while (end > token && *end == ' ') end--;
-      *(end + 1) = '\0';
-      paths[i] = strdup(token);
-      if (!paths[i]) {
-         for (int j = 0; j < i; j++) free(paths[j]);
-         free(paths);
-         free(path_copy);
-         *path_count = 0;
-         return NULL;
-      }
+// Count a request, returning its metrics index
+static int count_request(const MethodDescriptor *method) {
+   size_t i = method ? (size_t)(method - methods) : METHOD_COUNT;
+   metric_add(&metrics.requests[i], 1);
+   return (int)i;
+}
+
+// Count the error code of a response, if it is an error
+static void count_response_error(json_t *response) {
+   json_t *code = json_object_get(json_object_get(response, "error"), "code");
+   if (!json_is_integer(code)) {
+      return;
+   }
+   size_t i = 0;
+   while (i < METRIC_ERROR_CODE_COUNT && metric_error_codes[i] != json_integer_value(code)) {
       i++;
-      token = strtok(NULL, ",");
    }
-   *path_count = i;
-   free(path_copy);
-   return paths;
+   metric_add(&metrics.errors[i], 1);
 }
 
-// Free parsed paths
-static void free_paths(char **paths, int path_count) {
-   if (paths) {
-      for (int i = 0; i < path_count; i++) {
-         free(paths[i]);
-      }
-      free(paths);
-   }
+// Signal handler for SIGTERM
+static void handle_sigterm(int sig) {
+   (void)sig; // Suppress unused parameter warning
+   shutdown_flag = 1;
+}
+
+// Signal handler for SIGUSR1, dumps the flight recorder from the main loop
+static void handle_sigusr1(int sig) {
+   (void)sig;
+   dump_flag = 1;
 }
 
 // Perform rbus get operation for multiple paths
-static json_t *rbus_get_value(rbusHandle_t handle, const char *path) {
-   int path_count;
-   char **paths = parse_paths(path, &path_count);
-   if (!paths || path_count == 0) {
-      free_paths(paths, path_count);
+static json_t *rbus_get_value(rbusHandle_t handle, json_t *path) {
+   PathList list;
+   if (path_list_init(&list, path) != 0) {
+      path_list_free(&list);
       return create_error_response(-32602, "Invalid or empty path", NULL);
    }
 
    int num_props;
    rbusProperty_t properties;
-   rbusError_t err = rbus_getExt(handle, path_count, (const char **)paths, &num_props, &properties);
+   int64_t start_ns = monotonic_ns();
+   rbusError_t err = rbus_getExt(handle, list.count, list.paths, &num_props, &properties);
+   record_rbus_call(RBUS_OP_GET, start_ns);
+   trace_rbus_error(err);
    if (err != RBUS_ERROR_SUCCESS) {
-      free_paths(paths, path_count);
+      path_list_free(&list);
       char err_msg[256];
       snprintf(err_msg, sizeof(err_msg), "rbus_getExt failed: %s", rbusError_ToString(err));
       return create_error_response(-32000, err_msg, NULL);
    }
 
+   start_ns = monotonic_ns();
    json_t *result = json_object();
    rbusProperty_t prop = properties;
    while (prop) {
@@ -276,331 +802,2963 @@ static json_t *rbus_get_value(rbusHandle_t handle, const char *path) {
       }
       prop = rbusProperty_GetNext(prop);
    }
+   trace_phase(STATS_CONVERT, start_ns);
 
    rbusProperty_Release(properties);
-   free_paths(paths, path_count);
+   path_list_free(&list);
    return result;
 }
 
 // Perform rbus set operation
 static int rbus_set_value(rbusHandle_t handle, const char *path, json_t *value) {
+   int64_t start_ns = monotonic_ns();
    rbusValue_t rbus_val = json_to_rbus_value(value);
+   trace_phase(STATS_CONVERT, start_ns);
    if (!rbus_val) {
       return -1;
    }
 
+   start_ns = monotonic_ns();
    rbusError_t err = rbus_set(handle, path, rbus_val, NULL);
+   record_rbus_call(RBUS_OP_SET, start_ns);
+   trace_rbus_error(err);
    rbusValue_Release(rbus_val);
    return err == RBUS_ERROR_SUCCESS ? 0 : -1;
 }
 
-// Event handler for rbus events
-static void event_handler(rbusHandle_t handle, rbusEvent_t const *event, rbusEventSubscription_t *subscription) {
-   struct lws *wsi = (struct lws *)subscription->userData;
-   if (!wsi) {
+// Monotonic clock in milliseconds
+static int64_t monotonic_ms(void) {
+   return monotonic_ns() / 1000000;
+}
+
+// Read a numeric rbus value as a double. Returns false for non-numeric types.
+static bool rbus_value_to_double(rbusValue_t value, double *out) {
+   if (!value) {
+      return false;
+   }
+
+   switch (rbusValue_GetType(value)) {
+   case RBUS_INT8:
+   case RBUS_INT16:
+   case RBUS_INT32:
+   case RBUS_INT64:
+      *out = (double)rbusValue_GetInt64(value);
+      return true;
+   case RBUS_UINT8:
+   case RBUS_UINT16:
+   case RBUS_UINT32:
+   case RBUS_UINT64:
+      *out = (double)rbusValue_GetUInt64(value);
+      return true;
+   case RBUS_SINGLE:
+   case RBUS_DOUBLE:
+      *out = rbusValue_GetDouble(value);
+      return true;
+   default:
+      return false;
+   }
+}
+
+// What the filters decided for an event
+typedef enum {
+   FILTER_PASS,  // Forward now
+   FILTER_DROP,  // Within the deadband of the last forwarded value
+   FILTER_DEFER, // Inside min_interval_ms: hold as the trailing event
+} FilterResult;
+
+// Apply a subscription's deadband and rate limit to an event, updating the
+// filter state when it passes (event_lock held). *number is set for numeric values.
+static FilterResult filter_event(Subscription *sub, rbusEventType_t type, rbusValue_t value, int64_t now_ms,
+   bool *numeric, double *number) {
+   const EventFilter *filter = &sub->filter;
+   *numeric = false;
+   if (type != RBUS_EVENT_VALUE_CHANGED) {
+      return FILTER_PASS;
+   }
+
+   *numeric = rbus_value_to_double(value, number);
+   if (*numeric && sub->has_last) {
+      double delta = *number > sub->last_value ? *number - sub->last_value : sub->last_value - *number;
+      double base = sub->last_value < 0 ? -sub->last_value : sub->last_value;
+      if (filter->deadband > 0 && delta < filter->deadband) {
+         return FILTER_DROP;
+      }
+      if (filter->deadband_percent > 0 && delta < base * filter->deadband_percent / 100.0) {
+         return FILTER_DROP;
+      }
+   }
+
+   if (filter->min_interval_ms > 0 && sub->last_sent_ms &&
+      now_ms - sub->last_sent_ms < filter->min_interval_ms) {
+      return FILTER_DEFER;
+   }
+
+   if (*numeric) {
+      sub->has_last = true;
+      sub->last_value = *number;
+   }
+   sub->last_sent_ms = now_ms;
+   return FILTER_PASS;
+}
+
+// Find a session by id (event_lock held)
+static Session *find_session(const char *id) {
+   for (Session *s = sessions; s; s = s->next) {
+      if (strcmp(s->id, id) == 0) {
+         return s;
+      }
+   }
+   return NULL;
+}
+
+// Find the event subscription for an event name in a session (event_lock held)
+static Subscription *find_subscription(const char *eventName, Session *session) {
+   const char *name = intern_find(eventName);
+   for (int i = name ? name_chain(intern_hash(name)) : -1; i >= 0; i = subscriptions[i].next_by_name) {
+      if (subscriptions[i].session == session && !subscriptions[i].rest && subscriptions[i].eventName == name) {
+         return &subscriptions[i];
+      }
+   }
+   return NULL;
+}
+
+// Find a wildcard's watch on a table (event_lock held)
+static Subscription *find_watch(const char *table, Wildcard *wildcard) {
+   const char *name = intern_find(table);
+   for (int i = name ? name_chain(intern_hash(name)) : -1; i >= 0; i = subscriptions[i].next_by_name) {
+      if (subscriptions[i].wildcard == wildcard && subscriptions[i].rest && subscriptions[i].eventName == name) {
+         return &subscriptions[i];
+      }
+   }
+   return NULL;
+}
+
+// Check whether a session holds any subscriptions (event_lock held)
+static bool session_has_subscriptions(Session *session) {
+   for (int i = 0; i < subscription_count; i++) {
+      if (subscriptions[i].session == session) {
+         return true;
+      }
+   }
+   return false;
+}
+
+// Check whether any entry still needs the rbus subscription for an interned
+// name (event_lock held)
+static bool event_name_in_use(const char *name) {
+   for (int i = name ? name_chain(intern_hash(name)) : -1; i >= 0; i = subscriptions[i].next_by_name) {
+      if (subscriptions[i].eventName == name) {
+         return true;
+      }
+   }
+   return false;
+}
+
+// Append event params to the session replay ring, evicting the oldest (event_lock held)
+static void record_event(Session *session, json_t *params) {
+   if (replay_buffer_size <= 0) {
       return;
    }
+   if (!session->replay) {
+      session->replay = calloc(replay_buffer_size, sizeof(json_t *));
+      if (!session->replay) {
+         return;
+      }
+   }
 
-   // Create JSON-RPC notification
-   json_t *notification = json_object();
-   json_object_set_new(notification, "jsonrpc", json_string("2.0"));
-   json_object_set_new(notification, "method", json_string("rbus_event"));
-   json_t *params = json_object();
-   json_object_set_new(params, "eventName", json_string(event->name));
-   json_object_set_new(params, "type", json_string(event->type == RBUS_EVENT_VALUE_CHANGED ? "value_changed" :
-      event->type == RBUS_EVENT_OBJECT_CREATED ? "object_created" :
-      event->type == RBUS_EVENT_OBJECT_DELETED ? "object_deleted" :
-      event->type == RBUS_EVENT_GENERAL ? "general" :
-      event->type == RBUS_EVENT_INITIAL_VALUE ? "initial_value" :
-      event->type == RBUS_EVENT_INTERVAL ? "interval" :
-      event->type == RBUS_EVENT_DURATION_COMPLETE ? "duration_complete" : "unknown"));
-   if (event->data) {
-      json_t *data = rbus_value_to_json(rbusObject_GetValue(event->data, "value"));
-      json_object_set_new(params, "data", data);
+   int slot = (session->replay_head + session->replay_count) % replay_buffer_size;
+   if (session->replay_count == replay_buffer_size) {
+      json_decref(session->replay[slot]);
+      session->replay_head = (session->replay_head + 1) % replay_buffer_size;
    } else {
-      json_object_set_new(params, "data", json_null());
+      session->replay_count++;
    }
-   json_object_set_new(notification, "params", params);
+   session->replay[slot] = json_incref(params);
+}
 
-   char *notification_str = json_dumps(notification, JSON_COMPACT);
-   if (notification_str) {
-      lws_write(wsi, (unsigned char *)notification_str, strlen(notification_str), LWS_WRITE_TEXT);
-      free(notification_str);
+// Append a stamp, growing the queue as needed. Returns false if out of memory.
+static bool stamp_push(StampQueue *queue, int64_t received_ns, int64_t queued_ns) {
+   if (queue->count == queue->capacity) {
+      size_t capacity = queue->capacity ? queue->capacity * 2 : 16;
+      EventStamp *items = malloc(capacity * sizeof(EventStamp));
+      if (!items) {
+         return false;
+      }
+      for (size_t i = 0; i < queue->count; i++) {
+         items[i] = queue->items[(queue->head + i) % queue->capacity];
+      }
+      free(queue->items);
+      queue->items = items;
+      queue->head = 0;
+      queue->capacity = capacity;
    }
-   json_decref(notification);
+   queue->items[(queue->head + queue->count) % queue->capacity] = (EventStamp){ received_ns, queued_ns };
+   queue->count++;
+   return true;
 }
 
-// Add subscription
-static int add_subscription(const char *eventName, struct lws *wsi) {
-   if (subscription_count >= MAX_SUBSCRIPTIONS) {
-      return -1;
+static bool stamp_pop(StampQueue *queue, EventStamp *stamp) {
+   if (queue->count == 0) {
+      return false;
+   }
+   *stamp = queue->items[queue->head];
+   queue->head = (queue->head + 1) % queue->capacity;
+   queue->count--;
+   return true;
+}
+
+static void stamp_free(StampQueue *queue) {
+   free(queue->items);
+   memset(queue, 0, sizeof(*queue));
+}
+
+// Queue event params on a connection (event_lock held). Takes ownership of params.
+static void queue_event(Connection *conn, json_t *params, bool batch, int64_t received_ns) {
+   if (json_array_size(conn->pending) + json_array_size(conn->batch) >= MAX_PENDING_EVENTS) {
+      metric_add(&metrics.events_dropped, 1);
+      json_decref(params);
+      return;
    }
 
-   for (int i = 0; i < subscription_count; i++) {
-      if (strcmp(subscriptions[i].eventName, eventName) == 0 && subscriptions[i].wsi == wsi) {
-         return 0; // Subscription already exists
+   int64_t queued_ns = monotonic_ns();
+   if (!stamp_push(batch ? &conn->batch_stamps : &conn->pending_stamps, received_ns, queued_ns)) {
+      metric_add(&metrics.events_dropped, 1);
+      json_decref(params);
+      return;
+   }
+   if (received_ns) {
+      histogram_record(&event_stages[EVENT_STAGE_HANDLER], (uint64_t)(queued_ns - received_ns));
+   }
+
+   if (batch) {
+      json_array_append_new(conn->batch, params);
+   } else {
+      json_array_append_new(conn->pending, create_notification("rbus_event", params));
+   }
+}
+
+// Queue a deferred response on a connection, in order with its events (event_lock
+// held). Takes ownership of response. Responses are not subject to the event limit.
+static void queue_response(Connection *conn, json_t *response) {
+   // A zero received time keeps the response out of the event latency stages
+   if (!stamp_push(&conn->pending_stamps, 0, monotonic_ns())) {
+      json_decref(response);
+      return;
+   }
+   json_array_append_new(conn->pending, response);
+}
+
+// Stamp event params with the session's next seq, record them for replay and
+// queue them on the attached connection (event_lock held). Returns true if queued.
+static bool deliver_event(Subscription *sub, json_t *params, int64_t received_ns) {
+   Session *session = sub->session;
+   // Whatever follows a snapshot, the client no longer has only its value
+   json_decref(sub->snapshot_value);
+   sub->snapshot_value = NULL;
+   json_t *event = json_copy(params);
+   if (!event) {
+      return false;
+   }
+   json_object_set_new(event, "seq", json_integer((json_int_t)++session->seq));
+   record_event(session, event);
+   if (session->conn) {
+      queue_event(session->conn, event, sub->batch, received_ns);
+      return true;
+   }
+   json_decref(event);
+   return false;
+}
+
+// Hold event params back until an owed snapshot response is queued (event_lock held)
+static void hold_event(Subscription *sub, json_t *params) {
+   if (!sub->held) {
+      sub->held = json_array();
+   }
+   json_array_append(sub->held, params);
+}
+
+// Check whether event params are a value change repeating the value sent in an
+// inexact snapshot, which the snapshot already includes (event_lock held). A
+// provider may publish a change after a get has read it.
+static bool repeats_snapshot(const Subscription *sub, json_t *params) {
+   const char *type = json_string_value(json_object_get(params, "type"));
+   return sub->snapshot_value && type && strcmp(type, event_type_to_string(RBUS_EVENT_VALUE_CHANGED)) == 0 &&
+      json_equal(json_object_get(params, "data"), sub->snapshot_value);
+}
+
+// Answer a snapshot subscribe (event_lock held). snapshot maps the event name
+// to its current value and is owned by this call; NULL answers with error. Events
+// held while the value was read follow the response, after its seq. For an
+// inexact snapshot, those received before the get was issued and changes
+// repeating its value are dropped, so the client sees no gap or duplicate.
+static void complete_snapshot(Subscription *sub, json_t *snapshot, bool exact, const char *error) {
+   Session *session = sub->session;
+   json_decref(sub->snapshot_value);
+   sub->snapshot_value = NULL;
+   size_t skip = 0;
+   if (snapshot && !exact) {
+      sub->snapshot_value = json_incref(json_object_get(snapshot, sub->eventName));
+      if (json_is_number(sub->snapshot_value)) {
+         sub->has_last = true;
+         sub->last_value = json_number_value(sub->snapshot_value);
+      }
+      skip = sub->held_at_fetch;
+   }
+   sub->held_at_fetch = 0;
+
+   json_t *response;
+   if (snapshot) {
+      json_t *result = json_object();
+      json_object_set_new(result, "snapshot", snapshot);
+      json_object_set_new(result, "seq", json_integer((json_int_t)session->seq));
+      json_object_set_new(result, "exact", json_boolean(exact));
+      response = create_success_response(result, sub->snapshot_id);
+   } else {
+      response = create_error_response(-32000, error, sub->snapshot_id);
+   }
+   if (session->conn && sub->snapshot_id) {
+      queue_response(session->conn, response);
+   } else {
+      json_decref(response);
+   }
+   json_decref(sub->snapshot_id);
+   sub->snapshot_id = NULL;
+   sub->snapshot = SNAPSHOT_NONE;
+
+   json_t *held = sub->held;
+   sub->held = NULL;
+   size_t index;
+   json_t *params;
+   json_array_foreach(held, index, params) {
+      if (index >= skip && !repeats_snapshot(sub, params)) {
+         deliver_event(sub, params, 0);
       }
    }
+   json_decref(held);
+}
 
-   subscriptions[subscription_count].eventName = strdup(eventName);
-   if (!subscriptions[subscription_count].eventName) {
-      return -1;
+// Hand a job to the rbus worker (event_lock held)
+static void queue_rbus_job(RbusJob *job) {
+   RbusJob **tail = &rbus_jobs;
+   while (*tail) {
+      tail = &(*tail)->next;
    }
-   subscriptions[subscription_count].wsi = wsi;
+   *tail = job;
+   pthread_cond_signal(&rbus_job_ready);
+}
 
-   rbusEventSubscription_t sub = {
-       .eventName = eventName,
-       .handler = (rbusEventHandler_t)event_handler,
-       .userData = wsi,
-       .filter = NULL,
-       .interval = 0,
-       .duration = 0,
-       .publishOnSubscribe = true
-   };
+// Release a job and what it holds
+static void free_rbus_job(RbusJob *job) {
+   intern_release(job->eventName);
+   json_decref(job->result);
+   free(job->table);
+   free(job->rest);
+   free(job);
+}
 
-   rbusError_t err = rbusEvent_Subscribe(g_rbusHandle, eventName, (rbusEventHandler_t)event_handler, wsi, 30);
-   if (err != RBUS_ERROR_SUCCESS) {
-      free(subscriptions[subscription_count].eventName);
+// Have the rbus worker read the value for a snapshot subscribe, holding the
+// entry's events until it is in (event_lock held). created means a failed get
+// removes the entry. Returns -1 if the job cannot be queued.
+static int queue_snapshot(Subscription *sub, bool created) {
+   RbusJob *job = calloc(1, sizeof(RbusJob));
+   const char *name = job ? intern(sub->eventName) : NULL;
+   if (!name) {
+      free(job);
       return -1;
    }
-
-   subscription_count++;
+   job->type = RBUS_JOB_SNAPSHOT;
+   job->eventName = name;
+   job->ticket = ++snapshot_tickets;
+   job->created = created;
+   sub->snapshot = SNAPSHOT_FETCHING;
+   sub->snapshot_ticket = job->ticket;
+   queue_rbus_job(job);
    return 0;
 }
 
-// Remove subscription
-static int remove_subscription(const char *eventName, struct lws *wsi) {
-   for (int i = 0; i < subscription_count; i++) {
-      if (strcmp(subscriptions[i].eventName, eventName) == 0 && subscriptions[i].wsi == wsi) {
-         rbusEvent_Unsubscribe(g_rbusHandle, eventName);
-         free(subscriptions[i].eventName);
-         for (int j = i; j < subscription_count - 1; j++) {
-            subscriptions[j] = subscriptions[j + 1];
-         }
-         subscription_count--;
-         return 0;
+// Find the entry a snapshot job reads the value for, or NULL if it was
+// unsubscribed or answered meanwhile (event_lock held)
+static Subscription *find_fetch(const char *name, uint64_t ticket) {
+   for (int i = name_chain(intern_hash(name)); i >= 0; i = subscriptions[i].next_by_name) {
+      Subscription *sub = &subscriptions[i];
+      if (sub->eventName == name && sub->snapshot == SNAPSHOT_FETCHING && sub->snapshot_ticket == ticket) {
+         return sub;
       }
    }
-   return -1;
+   return NULL;
 }
 
-// Clean up subscriptions for a closed WebSocket
-static void cleanup_subscriptions(struct lws *wsi) {
-   for (int i = subscription_count - 1; i >= 0; i--) {
-      if (subscriptions[i].wsi == wsi) {
-         rbusEvent_Unsubscribe(g_rbusHandle, subscriptions[i].eventName);
-         free(subscriptions[i].eventName);
-         for (int j = i; j < subscription_count - 1; j++) {
-            subscriptions[j] = subscriptions[j + 1];
+// Hand a table row change seen by a wildcard watch to the lws thread (event_lock held)
+static void queue_row_change(Subscription *watch, rbusEvent_t const *event) {
+   rbusValue_t row_value = event->data ? rbusObject_GetValue(event->data, "rowName") : NULL;
+   const char *row = row_value ? rbusValue_GetString(row_value, NULL) : NULL;
+   if (!row) {
+      return;
+   }
+
+   RowChange *change = calloc(1, sizeof(RowChange));
+   if (!change) {
+      return;
+   }
+   change->wildcard = watch->wildcard;
+   change->row = strdup(row);
+   change->rest = strdup(watch->rest);
+   change->created = event->type == RBUS_EVENT_OBJECT_CREATED;
+   if (!change->row || !change->rest) {
+      free(change->row);
+      free(change->rest);
+      free(change);
+      return;
+   }
+
+   RowChange **tail = &row_changes;
+   while (*tail) {
+      tail = &(*tail)->next;
+   }
+   *tail = change;
+}
+
+// Event handler for rbus events. There is one rbus subscription per event name,
+// shared by every session and wildcard watch subscribed to it.
+static void event_handler(rbusHandle_t handle, rbusEvent_t const *event, rbusEventSubscription_t *subscription) {
+   (void)handle;
+   int64_t received_ns = monotonic_ns();
+
+   // Built before taking the lock so the conversion does not hold up the lws thread
+   rbusValue_t value = event->data ? rbusObject_GetValue(event->data, "value") : NULL;
+   json_t *params = create_event_params(event, value);
+   if (event_timestamps) {
+      struct timespec now;
+      clock_gettime(CLOCK_REALTIME, &now);
+      json_object_set_new(params, "receivedAt",
+         json_real((double)now.tv_sec * 1e3 + (double)now.tv_nsec / 1e6));
+   }
+   int64_t now_ms = monotonic_ms();
+   metric_add(&metrics.events_received, 1);
+
+   bool wake = false;
+   int delivered = 0;
+   pthread_mutex_lock(&event_lock);
+   // Only the entries chained in the name's index bucket can match. The first
+   // with the name gives its interned copy; the rest compare by pointer, and the
+   // intern table lock is never taken on this thread.
+   const char *name = NULL;
+   for (int i = name_chain(intern_hash(subscription->eventName)); i >= 0; i = subscriptions[i].next_by_name) {
+      Subscription *sub = &subscriptions[i];
+      if (!name && strcmp(sub->eventName, subscription->eventName) == 0) {
+         name = sub->eventName;
+      }
+      if (sub->eventName != name) {
+         continue;
+      }
+
+      bool numeric;
+      double number = 0;
+      if (sub->rest) {
+         if (event->type == RBUS_EVENT_OBJECT_CREATED || event->type == RBUS_EVENT_OBJECT_DELETED) {
+            queue_row_change(sub, event);
+            wake = true;
+         }
+      } else if (event->type == RBUS_EVENT_INITIAL_VALUE) {
+         // The provider publishes the initial value ahead of any change on the same
+         // stream, so answering with it gives a snapshot with no gap or duplicate
+         if (sub->snapshot == SNAPSHOT_WAITING) {
+            json_t *snapshot = json_object();
+            json_object_set(snapshot, event->name, json_object_get(params, "data"));
+            sub->has_last = rbus_value_to_double(value, &sub->last_value);
+            complete_snapshot(sub, snapshot, true, NULL);
+            wake = true;
+         }
+      } else if (sub->snapshot == SNAPSHOT_WAITING && event->type == RBUS_EVENT_VALUE_CHANGED) {
+         // Older than the snapshot still to come
+         continue;
+      } else if (sub->snapshot == SNAPSHOT_NONE && repeats_snapshot(sub, params)) {
+         // Already in the snapshot the client was sent
+         continue;
+      } else {
+         switch (filter_event(sub, event->type, value, now_ms, &numeric, &number)) {
+         case FILTER_PASS:
+            if (sub->snapshot != SNAPSHOT_NONE) {
+               hold_event(sub, params);
+            } else if (deliver_event(sub, params, received_ns)) {
+               delivered++;
+               wake = true;
+            }
+            break;
+         case FILTER_DROP:
+            // The newest value is close to the last one sent, so an older held one is stale
+            json_decref(sub->trailing);
+            sub->trailing = NULL;
+            break;
+         case FILTER_DEFER: {
+            json_decref(sub->trailing);
+            sub->trailing = json_incref(params);
+            sub->trailing_received_ns = received_ns;
+            sub->trailing_numeric = numeric;
+            sub->trailing_value = number;
+            int64_t due_ms = sub->last_sent_ms + sub->filter.min_interval_ms;
+            if (!trailing_due_ms || due_ms < trailing_due_ms) {
+               trailing_due_ms = due_ms;
+               wake = true;
+            }
+            break;
+         }
+         }
+      }
+   }
+   pthread_mutex_unlock(&event_lock);
+
+   json_decref(params);
+   if (wake) {
+      lws_cancel_service(g_context);
+   }
+   flight_record(FLIGHT_EVENT, (uint16_t)event->type, 0, event->name, received_ns, monotonic_ns(), delivered);
+}
+
+// Send the trailing events whose interval has ended and arm the timer for the
+// next one (lws thread)
+static void flush_trailing_events(lws_sorted_usec_list_t *sul) {
+   (void)sul;
+   int64_t now_ms = monotonic_ms();
+   pthread_mutex_lock(&event_lock);
+   int64_t next_ms = 0;
+   for (int i = 0; trailing_due_ms && i < subscription_count; i++) {
+      Subscription *sub = &subscriptions[i];
+      if (!sub->trailing) {
+         continue;
+      }
+      int64_t due_ms = sub->last_sent_ms + sub->filter.min_interval_ms;
+      if (now_ms < due_ms) {
+         if (!next_ms || due_ms < next_ms) {
+            next_ms = due_ms;
+         }
+         continue;
+      }
+
+      if (sub->trailing_numeric) {
+         sub->has_last = true;
+         sub->last_value = sub->trailing_value;
+      }
+      sub->last_sent_ms = now_ms;
+      if (sub->snapshot != SNAPSHOT_NONE) {
+         hold_event(sub, sub->trailing);
+      } else {
+         deliver_event(sub, sub->trailing, sub->trailing_received_ns);
+      }
+      json_decref(sub->trailing);
+      sub->trailing = NULL;
+   }
+   trailing_due_ms = next_ms;
+   trailing_scheduled_ms = 0;
+   pthread_mutex_unlock(&event_lock);
+   // Write what was sent and re-arm the timer from the event loop
+   lws_cancel_service(g_context);
+}
+
+// Request writes or arm batch timers for connections with queued events, and
+// arm the timer for the next trailing event (lws thread)
+static void schedule_pending_events(void) {
+   pthread_mutex_lock(&event_lock);
+   for (Connection *conn = connections; conn; conn = conn->next) {
+      size_t batched = json_array_size(conn->batch);
+      if (json_array_size(conn->pending) > 0 || (batched > 0 && conn->batch_due) ||
+         batched >= (size_t)conn->batch_max_events) {
+         lws_callback_on_writable(conn->wsi);
+      } else if (batched > 0 && !conn->timer_armed) {
+         lws_set_timer_usecs(conn->wsi, (lws_usec_t)conn->batch_max_delay_ms * 1000);
+         conn->timer_armed = true;
+      }
+   }
+   if (trailing_due_ms && trailing_due_ms != trailing_scheduled_ms) {
+      int64_t wait_ms = trailing_due_ms - monotonic_ms();
+      lws_sul_schedule(g_context, 0, &trailing_sul, flush_trailing_events,
+         wait_ms > 0 ? (lws_usec_t)wait_ms * 1000 : 0);
+      trailing_scheduled_ms = trailing_due_ms;
+   }
+   pthread_mutex_unlock(&event_lock);
+}
+
+// Make room for a payload of len bytes
+static bool send_buffer_reserve(SendBuffer *buf, size_t len) {
+   if (len <= buf->capacity) {
+      return true;
+   }
+   size_t capacity = buf->capacity ? buf->capacity : SEND_BUFFER_INITIAL;
+   while (capacity < len) {
+      capacity *= 2;
+   }
+   unsigned char *data = realloc(buf->data, LWS_PRE + capacity);
+   if (!data) {
+      return false;
+   }
+   buf->data = data;
+   buf->capacity = capacity;
+   return true;
+}
+
+// Serialize json into the send buffer. Returns its length, or 0 on failure.
+static size_t send_buffer_dump(SendBuffer *buf, const json_t *json) {
+   size_t len = json_dumpb(json, buf->data ? (char *)buf->data + LWS_PRE : NULL, buf->capacity, JSON_COMPACT);
+   if (len > buf->capacity) {
+      if (!send_buffer_reserve(buf, len)) {
+         return 0;
+      }
+      len = json_dumpb(json, (char *)buf->data + LWS_PRE, buf->capacity, JSON_COMPACT);
+   }
+   return len;
+}
+
+// Write the len bytes in the send buffer as one message. lws keeps any part it
+// cannot send at once, so the buffer is free again on return.
+static int send_buffer_write(SendBuffer *buf, struct lws *wsi, size_t len, enum lws_write_protocol protocol) {
+   int written = lws_write(wsi, buf->data + LWS_PRE, len, protocol);
+   if (buf->capacity > SEND_BUFFER_MAX_KEPT) {
+      free(buf->data);
+      buf->data = NULL;
+      buf->capacity = 0;
+   }
+   return written;
+}
+
+static void send_buffer_free(SendBuffer *buf) {
+   free(buf->data);
+   buf->data = NULL;
+   buf->capacity = 0;
+}
+
+// Write protocol for messages on a connection
+static enum lws_write_protocol connection_write_protocol(const Connection *conn) {
+   switch (conn->transport) {
+   case TRANSPORT_SSE:
+      return LWS_WRITE_HTTP;
+   case TRANSPORT_RAW:
+      return LWS_WRITE_RAW;
+   default:
+      return LWS_WRITE_TEXT;
+   }
+}
+
+// Tell the client a response could not be built
+static void send_serialization_failed(Connection *conn) {
+   static const char message[] =
+      "{\"jsonrpc\":\"2.0\",\"error\":{\"code\":-32000,\"message\":\"Response serialization failed\"},\"id\":null}\n";
+   // Only raw sockets take the trailing newline
+   size_t len = sizeof(message) - (conn->transport == TRANSPORT_RAW ? 1 : 2);
+   unsigned char buffer[LWS_PRE + sizeof(message)];
+   memcpy(buffer + LWS_PRE, message, len);
+   lws_write(conn->wsi, buffer + LWS_PRE, len, connection_write_protocol(conn));
+}
+
+// Format a notification as a server-sent event in the send buffer. The method is
+// the event type and the params are the data. The id is the session id and the
+// seq of the (last) event, which the client sends back as Last-Event-ID when it
+// reconnects. Returns the length, or 0 on failure.
+static size_t sse_format_event(SendBuffer *buf, const Session *session, const json_t *notification) {
+   const char *method = json_string_value(json_object_get(notification, "method"));
+   json_t *params = json_object_get(notification, "params");
+   json_t *events = json_object_get(params, "events");
+   json_t *seq = json_object_get(json_is_array(events) ? json_array_get(events, json_array_size(events) - 1) : params, "seq");
+
+   char head[128];
+   int head_len = session && json_is_integer(seq) ?
+      snprintf(head, sizeof(head), "id: %s:%lld\nevent: %s\ndata: ", session->id,
+         (long long)json_integer_value(seq), method) :
+      snprintf(head, sizeof(head), "event: %s\ndata: ", method);
+   if (!method || head_len < 0 || (size_t)head_len >= sizeof(head) || !send_buffer_reserve(buf, head_len + 2)) {
+      return 0;
+   }
+
+   // Compact JSON has no raw newlines, so the data fits on one line
+   size_t room = buf->capacity - head_len - 2;
+   size_t json_len = json_dumpb(params, (char *)buf->data + LWS_PRE + head_len, room, JSON_COMPACT);
+   if (json_len > room) {
+      if (!send_buffer_reserve(buf, head_len + json_len + 2)) {
+         return 0;
+      }
+      json_len = json_dumpb(params, (char *)buf->data + LWS_PRE + head_len, json_len, JSON_COMPACT);
+   }
+   if (json_len == 0) {
+      return 0;
+   }
+   memcpy(buf->data + LWS_PRE, head, head_len);
+   memcpy(buf->data + LWS_PRE + head_len + json_len, "\n\n", 2);
+   return head_len + json_len + 2;
+}
+
+// Serialize a message in the connection's wire format: a WebSocket message, an
+// SSE event, or a line on a raw socket. Returns its length, or 0 on failure.
+static size_t connection_dump(Connection *conn, const json_t *message) {
+   if (conn->transport == TRANSPORT_SSE) {
+      return sse_format_event(&conn->send, conn->session, message);
+   }
+   size_t len = send_buffer_dump(&conn->send, message);
+   if (len == 0 || conn->transport != TRANSPORT_RAW) {
+      return len;
+   }
+   if (!send_buffer_reserve(&conn->send, len + 1)) {
+      return 0;
+   }
+   conn->send.data[LWS_PRE + len] = '\n';
+   return len + 1;
+}
+
+// Write the next queued notification for a connection (lws thread, writeable callback).
+// A pending batch goes out first so events keep their order, except before a
+// deferred response: the events batched behind it must follow it.
+static void write_pending_events(Connection *conn) {
+   json_t *notification = NULL;
+   size_t event_count = 1;
+   StampQueue *stamps = &conn->pending_stamps;
+
+   pthread_mutex_lock(&event_lock);
+   size_t batched = json_array_size(conn->batch);
+   json_t *head = json_array_get(conn->pending, 0);
+   bool response = head && !json_object_get(head, "method");
+   if (batched > 0 && !response && (conn->batch_due || batched >= (size_t)conn->batch_max_events ||
+      json_array_size(conn->pending) > 0)) {
+      event_count = batched;
+      json_t *params = json_object();
+      json_object_set_new(params, "events", conn->batch);
+      notification = create_notification("rbus_events", params);
+      conn->batch = json_array();
+      conn->batch_due = false;
+      stamps = &conn->batch_stamps;
+   } else if (json_array_size(conn->pending) > 0) {
+      notification = json_incref(json_array_get(conn->pending, 0));
+      json_array_remove(conn->pending, 0);
+   }
+   bool more = json_array_size(conn->pending) > 0 ||
+      (json_array_size(conn->batch) > 0 && conn->batch_due);
+   pthread_mutex_unlock(&event_lock);
+
+   if (notification) {
+      int64_t serialize_ns = monotonic_ns();
+      size_t notification_len = connection_dump(conn, notification);
+      int64_t write_ns = monotonic_ns();
+      histogram_record(&event_stages[EVENT_STAGE_SERIALIZE], (uint64_t)(write_ns - serialize_ns));
+      if (response && notification_len > 0) {
+         capture_frame(CAPTURE_RESPONSE, conn->id, conn->send.data + LWS_PRE, notification_len);
+      }
+      if (notification_len > 0 && send_buffer_write(&conn->send, conn->wsi, notification_len,
+            connection_write_protocol(conn)) >= 0) {
+         metric_add(&metrics.events_sent, response ? 0 : event_count);
+         metric_add(&metrics.bytes_sent, notification_len);
+      }
+      int64_t written_ns = monotonic_ns();
+      histogram_record(&event_stages[EVENT_STAGE_WRITE], (uint64_t)(written_ns - write_ns));
+      json_decref(notification);
+
+      // The notification's events are the oldest entries of their stamp queue
+      pthread_mutex_lock(&event_lock);
+      EventStamp stamp;
+      for (size_t i = 0; i < event_count && stamp_pop(stamps, &stamp); i++) {
+         if (stamp.received_ns) {
+            histogram_record(&event_stages[EVENT_STAGE_QUEUE], (uint64_t)(serialize_ns - stamp.queued_ns));
+            histogram_record(&event_stages[EVENT_STAGE_TOTAL], (uint64_t)(written_ns - stamp.received_ns));
+         }
+      }
+      pthread_mutex_unlock(&event_lock);
+   }
+
+   if (more) {
+      lws_callback_on_writable(conn->wsi);
+   }
+}
+
+// Release the fields of a subscription table entry (event_lock held)
+static void free_subscription_entry(Subscription *sub) {
+   intern_release(sub->eventName);
+   free(sub->rest);
+   json_decref(sub->snapshot_id);
+   json_decref(sub->held);
+   json_decref(sub->snapshot_value);
+   json_decref(sub->trailing);
+}
+
+// Remove the only subscription table entry for an interned name (event_lock held)
+static void drop_subscription_entry(const char *name) {
+   for (int i = name_chain(intern_hash(name)); i >= 0; i = subscriptions[i].next_by_name) {
+      if (subscriptions[i].eventName == name) {
+         free_subscription_entry(&subscriptions[i]);
+         remove_entry_at(i);
+         return;
+      }
+   }
+}
+
+// Add an entry to the subscription table, growing it as needed (event_lock held).
+// Returns the entry's interned name, or NULL on failure.
+static const char *append_subscription_entry(const char *eventName, Session *session, const SubscribeOptions *options,
+   Wildcard *wildcard, const char *rest) {
+   if (subscription_count >= MAX_SUBSCRIPTIONS) {
+      return NULL;
+   }
+   if (subscription_count == subscription_capacity) {
+      int capacity = subscription_capacity ? subscription_capacity * 2 : 64;
+      int *buckets = malloc(capacity * sizeof(int));
+      Subscription *grown = buckets ? realloc(subscriptions, capacity * sizeof(Subscription)) : NULL;
+      if (!grown) {
+         free(buckets);
+         return NULL;
+      }
+      subscriptions = grown;
+      subscription_capacity = capacity;
+      // Rehash the name index over the larger bucket array
+      free(name_buckets);
+      name_buckets = buckets;
+      for (int i = 0; i < capacity; i++) {
+         name_buckets[i] = -1;
+      }
+      for (int i = 0; i < subscription_count; i++) {
+         index_link(i);
+      }
+   }
+
+   Subscription *sub = &subscriptions[subscription_count];
+   memset(sub, 0, sizeof(*sub));
+   sub->eventName = intern(eventName);
+   sub->rest = rest ? strdup(rest) : NULL;
+   sub->snapshot_id = options->snapshot && options->id ? json_deep_copy(options->id) : NULL;
+   if (!sub->eventName || (rest && !sub->rest) || (options->snapshot && options->id && !sub->snapshot_id)) {
+      free_subscription_entry(sub);
+      return NULL;
+   }
+   if (options->snapshot) {
+      sub->snapshot = SNAPSHOT_WAITING;
+      sub->snapshot_deadline_ms = monotonic_ms() + SNAPSHOT_TIMEOUT_MS;
+   }
+   sub->session = session;
+   sub->batch = options->batch;
+   sub->filter = options->filter;
+   sub->wildcard = wildcard;
+   sub->name_hash = intern_hash(sub->eventName);
+   index_link(subscription_count++);
+   return sub->eventName;
+}
+
+// Register a table entry and, if no other entry shares the name, subscribe it on
+// rbus. A snapshot entry waits for the initial value rbus is asked to publish, or
+// when the name is already subscribed and none will come, for rbus_getExt on the
+// rbus worker.
+static int subscribe_entry(const char *eventName, Session *session, const SubscribeOptions *options,
+   Wildcard *wildcard, const char *rest) {
+   // Register before subscribing so the initial event is not dropped
+   pthread_mutex_lock(&event_lock);
+   bool shared = event_name_in_use(intern_find(eventName));
+   const char *name = append_subscription_entry(eventName, session, options, wildcard, rest);
+   if (name && shared && options->snapshot && queue_snapshot(&subscriptions[subscription_count - 1], true) != 0) {
+      free_subscription_entry(&subscriptions[subscription_count - 1]);
+      remove_entry_at(subscription_count - 1);
+      name = NULL;
+   }
+   pthread_mutex_unlock(&event_lock);
+   if (!name) {
+      return -1;
+   }
+   if (shared) {
+      return 0;
+   }
+
+   rbusEventSubscription_t sub = {
+       .eventName = name,
+       .handler = (rbusEventHandler_t)event_handler,
+       .userData = NULL,
+       .filter = NULL,
+       .interval = 0,
+       .duration = 0,
+       .publishOnSubscribe = options->snapshot
+   };
+
+   int64_t start_ns = monotonic_ns();
+   rbusError_t err = rbusEvent_SubscribeEx(g_rbusHandle, &sub, 1, options->timeout);
+   record_rbus_call(RBUS_OP_SUBSCRIBE, start_ns);
+   trace_rbus_error(err);
+   if (err != RBUS_ERROR_SUCCESS) {
+      pthread_mutex_lock(&event_lock);
+      drop_subscription_entry(name);
+      pthread_mutex_unlock(&event_lock);
+      return -1;
+   }
+   return 0;
+}
+
+// Order interned names by address, which groups equal names
+static int compare_names(const void *a, const void *b) {
+   uintptr_t x = (uintptr_t)*(const char *const *)a;
+   uintptr_t y = (uintptr_t)*(const char *const *)b;
+   return x < y ? -1 : x > y;
+}
+
+// Remove entry i, answering a snapshot it still owes, and return its interned
+// name, whose reference passes to the caller (event_lock held)
+static const char *take_subscription_entry(int i) {
+   Subscription *sub = &subscriptions[i];
+   if (sub->snapshot != SNAPSHOT_NONE) {
+      json_decref(sub->held);
+      sub->held = NULL;
+      complete_snapshot(sub, NULL, false, "Unsubscribed before the snapshot was taken");
+   }
+   const char *name = sub->eventName;
+   sub->eventName = NULL;
+   free_subscription_entry(sub);
+   remove_entry_at(i);
+   return name;
+}
+
+// Unsubscribe an event name on rbus and drop the caller's reference to it
+static void unsubscribe_name(const char *name) {
+   int64_t start_ns = monotonic_ns();
+   rbusEvent_Unsubscribe(g_rbusHandle, name);
+   record_rbus_call(RBUS_OP_UNSUBSCRIBE, start_ns);
+   intern_release(name);
+}
+
+// remove_subscription_entries when its name list cannot be allocated: remove
+// the entries one at a time, unsubscribing each name no other entry shares
+static int remove_subscription_entries_singly(bool (*match)(const Subscription *, const void *), const void *arg) {
+   int removed = 0;
+   for (;;) {
+      const char *name = NULL;
+      pthread_mutex_lock(&event_lock);
+      for (int i = subscription_count - 1; i >= 0 && !name; i--) {
+         if (match(&subscriptions[i], arg)) {
+            name = take_subscription_entry(i);
+         }
+      }
+      bool shared = name && event_name_in_use(name);
+      if (shared) {
+         intern_release(name);
+      }
+      pthread_mutex_unlock(&event_lock);
+      if (!name) {
+         return removed;
+      }
+      removed++;
+      if (!shared) {
+         unsubscribe_name(name);
+      }
+   }
+}
+
+// Remove every entry selected by match and unsubscribe the rbus event names no
+// other entry still shares. Returns the number of entries removed. rbus calls are
+// made without the lock so the event thread is never blocked on us.
+static int remove_subscription_entries(bool (*match)(const Subscription *, const void *), const void *arg) {
+   int removed = 0;
+   const char **names = NULL;
+
+   pthread_mutex_lock(&event_lock);
+   for (int i = subscription_count - 1; i >= 0; i--) {
+      if (match(&subscriptions[i], arg)) {
+         removed++;
+      }
+   }
+   if (removed > 0) {
+      names = malloc(removed * sizeof(char *));
+   }
+   if (!names) {
+      pthread_mutex_unlock(&event_lock);
+      if (removed > 0) {
+         lwsl_warn("Cannot allocate the names of %d subscriptions, removing them one at a time\n", removed);
+         return remove_subscription_entries_singly(match, arg);
+      }
+      return 0;
+   }
+
+   int name_count = 0;
+   for (int i = subscription_count - 1; i >= 0; i--) {
+      if (match(&subscriptions[i], arg)) {
+         names[name_count++] = take_subscription_entry(i);
+      }
+   }
+
+   qsort(names, name_count, sizeof(char *), compare_names);
+   int unused_count = 0;
+   for (int i = 0; i < name_count; i++) {
+      if ((i > 0 && names[i] == names[i - 1]) || event_name_in_use(names[i])) {
+         intern_release(names[i]);
+      } else {
+         names[unused_count++] = names[i];
+      }
+   }
+   pthread_mutex_unlock(&event_lock);
+
+   for (int i = 0; i < unused_count; i++) {
+      unsubscribe_name(names[i]);
+   }
+   free(names);
+   return removed;
+}
+
+// Check whether an event name contains {i} or * row placeholders
+static bool is_wildcard(const char *eventName) {
+   return strstr(eventName, "{i}") || strchr(eventName, '*');
+}
+
+// Concatenate a row or table prefix and a pattern remainder
+static char *join_path(const char *prefix, const char *rest, size_t rest_len) {
+   size_t prefix_len = strlen(prefix);
+   bool dot = prefix_len > 0 && prefix[prefix_len - 1] != '.';
+   char *path = malloc(prefix_len + dot + rest_len + 1);
+   if (path) {
+      memcpy(path, prefix, prefix_len);
+      if (dot) {
+         path[prefix_len] = '.';
+      }
+      memcpy(path + prefix_len + dot, rest, rest_len);
+      path[prefix_len + dot + rest_len] = '\0';
+   }
+   return path;
+}
+
+// Expand the pattern rest below prefix against the data model (lws thread).
+// Names without placeholders are subscribed directly; for the first {i} or *
+// the table is watched for row changes, and the rbus worker lists its existing
+// rows, which are then expanded like created ones. Returns -1 if this level
+// could not be subscribed.
+static int expand_wildcard(Wildcard *wildcard, const char *prefix, const char *rest) {
+   SubscribeOptions options = { .timeout = wildcard->timeout, .batch = wildcard->batch, .filter = wildcard->filter };
+
+   const char *segment = rest;
+   const char *placeholder = NULL;
+   size_t placeholder_len = 0;
+   while (*segment) {
+      const char *dot = strchr(segment, '.');
+      size_t len = dot ? (size_t)(dot - segment) : strlen(segment);
+      if ((len == 3 && strncmp(segment, "{i}", 3) == 0) || (len == 1 && *segment == '*')) {
+         placeholder = segment;
+         placeholder_len = len;
+         break;
+      }
+      if (!dot) {
+         break;
+      }
+      segment = dot + 1;
+   }
+
+   if (!placeholder) {
+      char *name = join_path(prefix, rest, strlen(rest));
+      if (!name) {
+         return -1;
+      }
+      pthread_mutex_lock(&event_lock);
+      bool exists = find_subscription(name, wildcard->session) != NULL;
+      pthread_mutex_unlock(&event_lock);
+      int rc = exists ? 0 : subscribe_entry(name, wildcard->session, &options, wildcard, NULL);
+      free(name);
+      return rc;
+   }
+
+   const char *below = placeholder + placeholder_len;
+   if (*below == '.') {
+      below++;
+   }
+   char *table = join_path(prefix, rest, (size_t)(placeholder - rest));
+   if (!table) {
+      return -1;
+   }
+
+   pthread_mutex_lock(&event_lock);
+   bool watched = find_watch(table, wildcard) != NULL;
+   pthread_mutex_unlock(&event_lock);
+   if (!watched && subscribe_entry(table, wildcard->session, &options, wildcard, below) != 0) {
+      lwsl_warn("Wildcard %s: cannot watch table %s\n", wildcard->pattern, table);
+      free(table);
+      return -1;
+   }
+
+   RbusJob *job = calloc(1, sizeof(RbusJob));
+   if (job) {
+      job->type = RBUS_JOB_ROW_NAMES;
+      job->wildcard = wildcard;
+      job->table = table;
+      job->rest = strdup(below);
+   }
+   if (!job || !job->rest) {
+      lwsl_warn("Wildcard %s: cannot list the rows of %s\n", wildcard->pattern, table);
+      free(job);
+      free(table);
+      return 0;
+   }
+   pthread_mutex_lock(&event_lock);
+   queue_rbus_job(job);
+   pthread_mutex_unlock(&event_lock);
+   return 0;
+}
+
+static bool match_wildcard(const Subscription *sub, const void *arg) {
+   return sub->wildcard == arg;
+}
+
+typedef struct {
+   Wildcard *wildcard;
+   const char *row;
+   size_t row_len;
+} RowMatch;
+
+// Entries of a wildcard at or below a row. The row name may lack its trailing
+// dot, so Table.1 must not take Table.10 with it.
+static bool match_wildcard_row(const Subscription *sub, const void *arg) {
+   const RowMatch *m = arg;
+   if (sub->wildcard != m->wildcard || strncmp(sub->eventName, m->row, m->row_len) != 0) {
+      return false;
+   }
+   char next = sub->eventName[m->row_len];
+   return next == '\0' || next == '.' || (m->row_len > 0 && m->row[m->row_len - 1] == '.');
+}
+
+// Unlink and free a wildcard after its entries have been removed (lws thread)
+static void free_wildcard(Wildcard *wildcard) {
+   for (Wildcard **p = &wildcards; *p; p = &(*p)->next) {
+      if (*p == wildcard) {
+         *p = wildcard->next;
+         break;
+      }
+   }
+   free(wildcard->pattern);
+   free(wildcard);
+}
+
+// Find a session's wildcard subscription by pattern (lws thread)
+static Wildcard *find_wildcard(const char *pattern, Session *session) {
+   for (Wildcard *w = wildcards; w; w = w->next) {
+      if (w->session == session && strcmp(w->pattern, pattern) == 0) {
+         return w;
+      }
+   }
+   return NULL;
+}
+
+// Subscribe a wildcard pattern, expanding it against the current data model
+static int add_wildcard(const char *pattern, Session *session, const SubscribeOptions *options) {
+   if (find_wildcard(pattern, session)) {
+      return 0; // Subscription already exists
+   }
+
+   Wildcard *wildcard = calloc(1, sizeof(Wildcard));
+   if (!wildcard) {
+      return -1;
+   }
+   wildcard->pattern = strdup(pattern);
+   if (!wildcard->pattern) {
+      free(wildcard);
+      return -1;
+   }
+   wildcard->session = session;
+   wildcard->batch = options->batch;
+   wildcard->timeout = options->timeout;
+   wildcard->filter = options->filter;
+   wildcard->next = wildcards;
+   wildcards = wildcard;
+
+   if (expand_wildcard(wildcard, "", pattern) != 0) {
+      remove_subscription_entries(match_wildcard, wildcard);
+      free_wildcard(wildcard);
+      return -1;
+   }
+   return 0;
+}
+
+// Remove a wildcard subscription and everything expanded from it
+static int remove_wildcard(const char *pattern, Session *session) {
+   Wildcard *w = find_wildcard(pattern, session);
+   if (!w) {
+      return -1;
+   }
+   remove_subscription_entries(match_wildcard, w);
+   free_wildcard(w);
+   return 0;
+}
+
+// Expand created or newly listed rows and drop deleted ones for wildcard
+// subscriptions (lws thread)
+static void process_row_changes(void) {
+   for (;;) {
+      pthread_mutex_lock(&event_lock);
+      RowChange *change = row_changes;
+      if (change) {
+         row_changes = change->next;
+      }
+      pthread_mutex_unlock(&event_lock);
+      if (!change) {
+         break;
+      }
+
+      // The wildcard may have been unsubscribed since the change was queued
+      Wildcard *wildcard = wildcards;
+      while (wildcard && wildcard != change->wildcard) {
+         wildcard = wildcard->next;
+      }
+      if (wildcard && change->created) {
+         expand_wildcard(wildcard, change->row, change->rest);
+      } else if (wildcard) {
+         RowMatch m = { wildcard, change->row, strlen(change->row) };
+         remove_subscription_entries(match_wildcard_row, &m);
+      }
+
+      free(change->row);
+      free(change->rest);
+      free(change);
+   }
+}
+
+typedef struct {
+   const char *eventName;
+   Session *session;
+} NameMatch;
+
+static bool match_event_name(const Subscription *sub, const void *arg) {
+   const NameMatch *m = arg;
+   return sub->session == m->session && !sub->rest && sub->eventName == m->eventName;
+}
+
+// Remove subscription
+static int remove_subscription(const char *eventName, Session *session) {
+   // Interned lookups are safe here: entries only go away on this thread
+   NameMatch m = { intern_find(eventName), session };
+   if (!m.eventName) {
+      return -1;
+   }
+   return remove_subscription_entries(match_event_name, &m) > 0 ? 0 : -1;
+}
+
+// List the rows of a job's table as row changes that expand the job's pattern
+// below each row (rbus worker thread)
+static RowChange *list_table_rows(const RbusJob *job) {
+   rbusRowName_t *rows = NULL;
+   int64_t start_ns = monotonic_ns();
+   rbusError_t err = rbusTable_getRowNames(g_rbusHandle, job->table, &rows);
+   record_rbus_call(RBUS_OP_GET_ROW_NAMES, start_ns);
+   if (err != RBUS_ERROR_SUCCESS) {
+      return NULL;
+   }
+
+   RowChange *changes = NULL;
+   RowChange **tail = &changes;
+   for (rbusRowName_t *row = rows; row; row = row->next) {
+      RowChange *change = calloc(1, sizeof(RowChange));
+      if (!change) {
+         break;
+      }
+      change->wildcard = job->wildcard;
+      change->row = strdup(row->name);
+      change->rest = strdup(job->rest);
+      change->created = true;
+      if (!change->row || !change->rest) {
+         free(change->row);
+         free(change->rest);
+         free(change);
+         break;
+      }
+      *tail = change;
+      tail = &change->next;
+   }
+   rbusTable_freeRowNames(g_rbusHandle, rows);
+   return changes;
+}
+
+// Run queued rbus jobs until the server stops (rbus worker thread)
+static void *run_rbus_worker(void *arg) {
+   (void)arg;
+   pthread_mutex_lock(&event_lock);
+   while (!rbus_worker_stop) {
+      RbusJob *job = rbus_jobs;
+      if (!job) {
+         pthread_cond_wait(&rbus_job_ready, &event_lock);
+         continue;
+      }
+      rbus_jobs = job->next;
+      job->next = NULL;
+
+      if (job->type == RBUS_JOB_ROW_NAMES) {
+         // The lws thread expands the rows like rows created later
+         pthread_mutex_unlock(&event_lock);
+         RowChange *rows = list_table_rows(job);
+         pthread_mutex_lock(&event_lock);
+         RowChange **tail = &row_changes;
+         while (*tail) {
+            tail = &(*tail)->next;
+         }
+         *tail = rows;
+         free_rbus_job(job);
+         pthread_mutex_unlock(&event_lock);
+         lws_cancel_service(g_context);
+         pthread_mutex_lock(&event_lock);
+         continue;
+      }
+
+      // Events held so far were received before the get, so its result has them
+      Subscription *sub = find_fetch(job->eventName, job->ticket);
+      bool fetch = sub != NULL;
+      if (sub) {
+         sub->held_at_fetch = sub->held ? json_array_size(sub->held) : 0;
+      }
+      pthread_mutex_unlock(&event_lock);
+
+      if (fetch) {
+         json_t *path = json_string(job->eventName);
+         job->result = rbus_get_value(g_rbusHandle, path);
+         json_decref(path);
+      }
+
+      pthread_mutex_lock(&event_lock);
+      RbusJob **tail = &rbus_jobs_done;
+      while (*tail) {
+         tail = &(*tail)->next;
+      }
+      *tail = job;
+      pthread_mutex_unlock(&event_lock);
+      lws_cancel_service(g_context);
+      pthread_mutex_lock(&event_lock);
+   }
+   pthread_mutex_unlock(&event_lock);
+   return NULL;
+}
+
+// Answer the snapshot subscribes whose value the rbus worker has read (lws
+// thread). When the get fails the subscribe fails, and a subscription it created
+// is removed again.
+static void process_rbus_jobs(void) {
+   bool answered = false;
+   for (;;) {
+      pthread_mutex_lock(&event_lock);
+      RbusJob *job = rbus_jobs_done;
+      if (job) {
+         rbus_jobs_done = job->next;
+      }
+      pthread_mutex_unlock(&event_lock);
+      if (!job) {
+         break;
+      }
+
+      json_t *snapshot = job->result;
+      bool failed = !json_is_object(snapshot) || json_object_get(snapshot, "error");
+      if (failed) {
+         json_decref(snapshot);
+         snapshot = NULL;
+      }
+      Session *session = NULL;
+      pthread_mutex_lock(&event_lock);
+      Subscription *sub = find_fetch(job->eventName, job->ticket);
+      if (sub) {
+         session = sub->session;
+         complete_snapshot(sub, snapshot, false, "Snapshot failed");
+         snapshot = NULL;
+         answered = true;
+      }
+      pthread_mutex_unlock(&event_lock);
+      json_decref(snapshot);
+
+      // Sessions only go away on this thread, so session is still valid
+      if (session && failed && job->created) {
+         remove_subscription(job->eventName, session);
+      }
+      job->result = NULL;
+      free_rbus_job(job);
+   }
+   if (answered) {
+      lws_cancel_service(g_context);
+   }
+}
+
+// Stop the rbus worker and drop the jobs it has not run (lws thread)
+static void stop_rbus_worker(void) {
+   pthread_mutex_lock(&event_lock);
+   rbus_worker_stop = true;
+   pthread_cond_signal(&rbus_job_ready);
+   pthread_mutex_unlock(&event_lock);
+   pthread_join(rbus_worker, NULL);
+
+   while (rbus_jobs) {
+      RbusJob *job = rbus_jobs;
+      rbus_jobs = job->next;
+      free_rbus_job(job);
+   }
+   process_rbus_jobs();
+}
+
+// Add subscription. With options->snapshot the response is deferred: it is
+// queued on the connection once the snapshot is taken, ahead of the first delta.
+static int add_subscription(const char *eventName, Session *session, const SubscribeOptions *options) {
+   pthread_mutex_lock(&event_lock);
+   Subscription *existing = find_subscription(eventName, session);
+   bool failed = existing && options->snapshot && existing->snapshot != SNAPSHOT_NONE;
+   if (existing && !failed) {
+      existing->batch = options->batch;
+      existing->filter = options->filter;
+      // Events already queued for it stay ahead of the response, at or below its seq
+      if (options->snapshot) {
+         existing->snapshot_id = options->id ? json_deep_copy(options->id) : NULL;
+         failed = (options->id && !existing->snapshot_id) || queue_snapshot(existing, false) != 0;
+         if (failed) {
+            json_decref(existing->snapshot_id);
+            existing->snapshot_id = NULL;
+         }
+      }
+   }
+   pthread_mutex_unlock(&event_lock);
+
+   if (failed || (!existing && subscribe_entry(eventName, session, options, NULL, NULL) != 0)) {
+      return -1;
+   }
+   return 0;
+}
+
+// Fall back to rbus_getExt for snapshot subscribes whose initial value has not
+// arrived in time (lws thread)
+static void expire_snapshots(void) {
+   int64_t now_ms = monotonic_ms();
+   pthread_mutex_lock(&event_lock);
+   for (int i = 0; i < subscription_count; i++) {
+      Subscription *sub = &subscriptions[i];
+      if (sub->snapshot != SNAPSHOT_WAITING || now_ms < sub->snapshot_deadline_ms) {
+         continue;
+      }
+      // Nobody is left to answer, or the get cannot be queued
+      if (!sub->session->conn || queue_snapshot(sub, true) != 0) {
+         complete_snapshot(sub, NULL, false, "Snapshot failed");
+      }
+   }
+   pthread_mutex_unlock(&event_lock);
+}
+
+static bool match_session(const Subscription *sub, const void *arg) {
+   return sub->session == arg;
+}
+
+// Clean up subscriptions for an expired session
+static void cleanup_subscriptions(Session *session) {
+   remove_subscription_entries(match_session, session);
+
+   Wildcard *w = wildcards;
+   while (w) {
+      Wildcard *next = w->next;
+      if (w->session == session) {
+         free_wildcard(w);
+      }
+      w = next;
+   }
+}
+
+// Create a session with a random id and add it to the session list
+static Session *create_session(void) {
+   Session *session = calloc(1, sizeof(Session));
+   if (!session) {
+      return NULL;
+   }
+
+   unsigned char id[SESSION_ID_BYTES];
+   if (lws_get_random(g_context, id, sizeof(id)) != sizeof(id)) {
+      free(session);
+      return NULL;
+   }
+   for (int i = 0; i < SESSION_ID_BYTES; i++) {
+      snprintf(session->id + i * 2, 3, "%02x", id[i]);
+   }
+
+   pthread_mutex_lock(&event_lock);
+   session->next = sessions;
+   sessions = session;
+   pthread_mutex_unlock(&event_lock);
+   return session;
+}
+
+// Unlink a session from the session list (event_lock held)
+static void unlink_session(Session *session) {
+   for (Session **p = &sessions; *p; p = &(*p)->next) {
+      if (*p == session) {
+         *p = session->next;
+         return;
+      }
+   }
+}
+
+// Release an unlinked session, its subscriptions and its replay buffer
+static void destroy_session(Session *session) {
+   cleanup_subscriptions(session);
+   for (int i = 0; i < session->replay_count; i++) {
+      json_decref(session->replay[(session->replay_head + i) % replay_buffer_size]);
+   }
+   free(session->replay);
+   free(session);
+}
+
+// Detach a session from its closing connection. Sessions without subscriptions
+// have nothing to resume and are dropped straight away.
+static void detach_session(Connection *conn) {
+   Session *session = conn->session;
+   if (!session) {
+      return;
+   }
+
+   bool drop = false;
+   pthread_mutex_lock(&event_lock);
+   conn->session = NULL;
+   if (session->conn == conn) {
+      session->conn = NULL;
+      session->expires = time(NULL) + session_grace_secs;
+      drop = session_grace_secs <= 0 || !session_has_subscriptions(session);
+      if (drop) {
+         unlink_session(session);
+      }
+   }
+   pthread_mutex_unlock(&event_lock);
+
+   if (drop) {
+      destroy_session(session);
+   }
+}
+
+// Drop detached sessions whose grace period has run out (lws thread)
+static void expire_sessions(void) {
+   time_t now = time(NULL);
+   for (;;) {
+      Session *expired = NULL;
+      pthread_mutex_lock(&event_lock);
+      for (Session *s = sessions; s; s = s->next) {
+         if (!s->conn && s->expires <= now) {
+            expired = s;
+            unlink_session(s);
+            break;
+         }
+      }
+      pthread_mutex_unlock(&event_lock);
+
+      if (!expired) {
+         break;
+      }
+      destroy_session(expired);
+   }
+}
+
+// Set up a new connection with a fresh session and add it to the connection
+// list. Returns -1 on failure, leaving nothing to clean up.
+static int connection_open(Connection *conn, struct lws *wsi, Transport transport) {
+   static unsigned long next_connection_id = 0;
+   memset(conn, 0, sizeof(*conn));
+   conn->wsi = wsi;
+   conn->transport = transport;
+   conn->id = ++next_connection_id;
+   conn->pending = json_array();
+   conn->batch = json_array();
+   conn->batch_max_events = DEFAULT_BATCH_MAX_EVENTS;
+   conn->batch_max_delay_ms = DEFAULT_BATCH_MAX_DELAY_MS;
+   conn->session = create_session();
+   if (!conn->session) {
+      json_decref(conn->pending);
+      json_decref(conn->batch);
+      conn->pending = NULL;
+      conn->batch = NULL;
+      return -1;
+   }
+
+   pthread_mutex_lock(&event_lock);
+   conn->session->conn = conn;
+   conn->next = connections;
+   connections = conn;
+   pthread_mutex_unlock(&event_lock);
+   atomic_fetch_add(&metrics.connections, 1);
+   return 0;
+}
+
+// Detach a closing connection from its session and release its queues
+static void connection_close(Connection *conn) {
+   atomic_fetch_sub(&metrics.connections, 1);
+   detach_session(conn);
+
+   pthread_mutex_lock(&event_lock);
+   for (Connection **p = &connections; *p; p = &(*p)->next) {
+      if (*p == conn) {
+         *p = conn->next;
+         break;
+      }
+   }
+   json_decref(conn->pending);
+   json_decref(conn->batch);
+   conn->pending = NULL;
+   conn->batch = NULL;
+   stamp_free(&conn->pending_stamps);
+   stamp_free(&conn->batch_stamps);
+   pthread_mutex_unlock(&event_lock);
+   send_buffer_free(&conn->send);
+   free(conn->input);
+   conn->input = NULL;
+   conn->input_len = 0;
+   conn->input_capacity = 0;
+}
+
+// The batch delay timer of a connection has fired
+static void connection_timer(Connection *conn) {
+   pthread_mutex_lock(&event_lock);
+   conn->timer_armed = false;
+   conn->batch_due = true;
+   pthread_mutex_unlock(&event_lock);
+   lws_callback_on_writable(conn->wsi);
+}
+
+// JSON-RPC handling
+static json_t *handle_rbus_get(json_t *params, json_t *id, struct lws *wsi) {
+   (void)wsi;
+   json_t *path = json_object_get(params, "path");
+   if (!json_is_string(path) && !json_is_array(path)) {
+      return create_error_response(-32602, "Invalid params", id);
+   }
+
+   json_t *value = rbus_get_value(g_rbusHandle, path);
+   if (json_is_object(value) && json_object_get(value, "error")) {
+      return value;
+   }
+
+   return create_success_response(value, id);
+}
+
+static json_t *handle_rbus_set(json_t *params, json_t *id, struct lws *wsi) {
+   (void)wsi;
+   const char *path = json_string_value(json_object_get(params, "path"));
+   json_t *value = json_object_get(params, "value");
+   if (!path || !value) {
+      return create_error_response(-32602, "Invalid params", id);
+   }
+
+   if (rbus_set_value(g_rbusHandle, path, value) != 0) {
+      return create_error_response(-32000, "Set failed", id);
+   }
+
+   return create_success_response(json_true(), id);
+}
+
+static json_t *handle_rbus_event_subscribe(json_t *params, json_t *id, struct lws *wsi) {
+   const char *eventName = json_string_value(json_object_get(params, "eventName"));
+   json_t *timeout_json = json_object_get(params, "timeout");
+   SubscribeOptions options = {
+      .timeout = timeout_json && json_is_integer(timeout_json) ? (int)json_integer_value(timeout_json) : 30,
+      .snapshot = json_is_true(json_object_get(params, "snapshot")),
+      .id = id ? id : in_batch ? NULL : json_null()
+   };
+
+   if (!eventName) {
+      return create_error_response(-32602, "Invalid params: eventName required", id);
+   }
+
+   Connection *conn = (Connection *)lws_wsi_user(wsi);
+   if (!conn->session) {
+      return create_error_response(-32000, "Session is no longer attached", id);
+   }
+
+   bool wildcard = is_wildcard(eventName);
+   if (wildcard && options.snapshot) {
+      return create_error_response(-32602, "Invalid params: snapshot is not supported for wildcard subscriptions", id);
+   }
+
+   // Optional server-side filters for noisy numeric values
+   json_t *deadband_json = json_object_get(params, "deadband");
+   json_t *deadband_percent_json = json_object_get(params, "deadbandPercent");
+   json_t *min_interval_json = json_object_get(params, "minIntervalMs");
+   if ((deadband_json && !json_is_number(deadband_json)) ||
+      (deadband_percent_json && !json_is_number(deadband_percent_json)) ||
+      (min_interval_json && !json_is_integer(min_interval_json))) {
+      return create_error_response(-32602, "Invalid params: deadband, deadbandPercent and minIntervalMs must be numbers", id);
+   }
+   options.filter.deadband = deadband_json ? json_number_value(deadband_json) : 0;
+   options.filter.deadband_percent = deadband_percent_json ? json_number_value(deadband_percent_json) : 0;
+   options.filter.min_interval_ms = min_interval_json ? (int)json_integer_value(min_interval_json) : 0;
+   if (options.filter.deadband < 0 || options.filter.deadband_percent < 0 ||
+      options.filter.min_interval_ms < 0) {
+      return create_error_response(-32602, "Invalid params: filters must not be negative", id);
+   }
+
+   // Optional batching: true, or {"maxEvents": n, "maxDelayMs": ms}
+   json_t *batch_json = json_object_get(params, "batch");
+   options.batch = json_is_true(batch_json) || json_is_object(batch_json);
+   if (options.batch) {
+      int max_events = DEFAULT_BATCH_MAX_EVENTS;
+      int max_delay_ms = DEFAULT_BATCH_MAX_DELAY_MS;
+      json_t *max_events_json = json_object_get(batch_json, "maxEvents");
+      json_t *max_delay_json = json_object_get(batch_json, "maxDelayMs");
+      if (json_is_integer(max_events_json)) {
+         max_events = (int)json_integer_value(max_events_json);
+      }
+      if (json_is_integer(max_delay_json)) {
+         max_delay_ms = (int)json_integer_value(max_delay_json);
+      }
+      if (max_events < 1 || max_events > MAX_PENDING_EVENTS || max_delay_ms < 0 || max_delay_ms > 10000) {
+         return create_error_response(-32602, "Invalid params: batch limits out of range", id);
+      }
+
+      // Batch limits apply to the whole connection; the latest subscribe wins
+      pthread_mutex_lock(&event_lock);
+      conn->batch_max_events = max_events;
+      conn->batch_max_delay_ms = max_delay_ms;
+      pthread_mutex_unlock(&event_lock);
+   }
+
+   int rc = wildcard ? add_wildcard(eventName, conn->session, &options) :
+      add_subscription(eventName, conn->session, &options);
+   if (rc != 0) {
+      return create_error_response(-32000, "Subscription failed", id);
+   }
+
+   // The snapshot response is queued on the connection once the value is in
+   if (options.snapshot) {
+      return NULL;
+   }
+   return create_success_response(json_true(), id);
+}
+
+static json_t *handle_rbus_event_unsubscribe(json_t *params, json_t *id, struct lws *wsi) {
+   const char *eventName = json_string_value(json_object_get(params, "eventName"));
+   if (!eventName) {
+      return create_error_response(-32602, "Invalid params: eventName required", id);
+   }
+
+   Connection *conn = (Connection *)lws_wsi_user(wsi);
+   int rc = !conn->session ? -1 : is_wildcard(eventName) ? remove_wildcard(eventName, conn->session) :
+      remove_subscription(eventName, conn->session);
+   if (rc != 0) {
+      return create_error_response(-32000, "Unsubscription failed: not subscribed", id);
+   }
+
+   return create_success_response(json_true(), id);
+}
+
+static json_t *handle_session_info(json_t *params, json_t *id, struct lws *wsi) {
+   (void)params;
+   Connection *conn = (Connection *)lws_wsi_user(wsi);
+   if (!conn->session) {
+      return create_error_response(-32000, "Session is no longer attached", id);
+   }
+
+   pthread_mutex_lock(&event_lock);
+   json_t *result = json_object();
+   json_object_set_new(result, "sessionId", json_string(conn->session->id));
+   json_object_set_new(result, "seq", json_integer((json_int_t)conn->session->seq));
+   json_object_set_new(result, "gracePeriod", json_integer(session_grace_secs));
+   pthread_mutex_unlock(&event_lock);
+
+   return create_success_response(result, id);
+}
+
+// Attach a detached (or still lingering) session to a connection and queue the
+// buffered events after last_seq for replay. If the ring no longer reaches back
+// that far the subscriptions are still resumed but "complete" is false and the
+// client must re-read current values. On success *result describes the resume;
+// with announce it is also queued as a "session" notification ahead of the
+// replayed events. Returns NULL, or an error message.
+static const char *attach_session(Connection *conn, const char *session_id, uint64_t last_seq, bool announce,
+   json_t **result) {
+   Session *discarded = NULL;
+
+   pthread_mutex_lock(&event_lock);
+   Session *session = find_session(session_id);
+   if (!session) {
+      pthread_mutex_unlock(&event_lock);
+      return "Unknown or expired session";
+   }
+   if (conn->session != session) {
+      if (conn->session && session_has_subscriptions(conn->session)) {
+         pthread_mutex_unlock(&event_lock);
+         return "Resume must precede subscriptions on a connection";
+      }
+
+      // Take the session over from a connection whose close we have not seen yet
+      Connection *previous = session->conn;
+      if (previous) {
+         previous->session = NULL;
+         lws_set_timeout(previous->wsi, PENDING_TIMEOUT_USER_OK, LWS_TO_KILL_ASYNC);
+      }
+
+      discarded = conn->session;
+      if (discarded) {
+         unlink_session(discarded);
+      }
+      conn->session = session;
+      session->conn = conn;
+   }
+
+   uint64_t oldest = session->seq - (uint64_t)session->replay_count + 1;
+   bool complete = last_seq <= session->seq && last_seq + 1 >= oldest;
+   int replayed = 0;
+   json_t *replay = json_array();
+   if (complete) {
+      for (int i = 0; i < session->replay_count; i++) {
+         uint64_t seq = oldest + (uint64_t)i;
+         if (seq > last_seq) {
+            json_t *event = session->replay[(session->replay_head + i) % replay_buffer_size];
+            json_array_append_new(replay, create_notification("rbus_event", json_incref(event)));
+         }
+      }
+   }
+
+   *result = json_object();
+   json_object_set_new(*result, "sessionId", json_string(session->id));
+   json_object_set_new(*result, "seq", json_integer((json_int_t)session->seq));
+   size_t first = json_array_size(conn->pending);
+   announce = announce && stamp_push(&conn->pending_stamps, 0, 0);
+   size_t index;
+   json_t *notification;
+   json_array_foreach(replay, index, notification) {
+      if (!stamp_push(&conn->pending_stamps, 0, 0)) {
+         complete = false;
+         break;
+      }
+      json_array_append(conn->pending, notification);
+      replayed++;
+   }
+   json_object_set_new(*result, "replayed", json_integer(replayed));
+   json_object_set_new(*result, "complete", json_boolean(complete));
+   if (announce) {
+      json_array_insert_new(conn->pending, first, create_notification("session", json_copy(*result)));
+   }
+   pthread_mutex_unlock(&event_lock);
+
+   json_decref(replay);
+   if (discarded) {
+      destroy_session(discarded);
+   }
+   if (announce || replayed > 0) {
+      lws_callback_on_writable(conn->wsi);
+   }
+   return NULL;
+}
+
+static json_t *handle_session_resume(json_t *params, json_t *id, struct lws *wsi) {
+   const char *session_id = json_string_value(json_object_get(params, "sessionId"));
+   json_t *last_seq_json = json_object_get(params, "lastSeq");
+   if (!session_id || !json_is_integer(last_seq_json) || json_integer_value(last_seq_json) < 0) {
+      return create_error_response(-32602, "Invalid params: sessionId and lastSeq required", id);
+   }
+
+   json_t *result;
+   const char *error = attach_session((Connection *)lws_wsi_user(wsi), session_id,
+      (uint64_t)json_integer_value(last_seq_json), false, &result);
+   if (error) {
+      return create_error_response(-32000, error, id);
+   }
+   return create_success_response(result, id);
+}
+
+// Recorded operations, oldest first, at most limit of them
+static json_t *flight_recorder_to_json(size_t limit) {
+   json_t *records = json_array();
+   if (!flight_records) {
+      return records;
+   }
+
+   // Report wall-clock times by offsetting the monotonic timestamps
+   struct timespec now;
+   clock_gettime(CLOCK_REALTIME, &now);
+   double offset_ms = (double)now.tv_sec * 1e3 + (double)now.tv_nsec / 1e6 - (double)monotonic_ns() / 1e6;
+
+   uint64_t end = atomic_load(&flight_next);
+   uint64_t count = end < flight_mask + 1 ? end : flight_mask + 1;
+   if (count > limit) {
+      count = limit;
+   }
+   for (uint64_t index = end - count; index < end; index++) {
+      FlightRecord record;
+      if (!flight_read(index, &record)) {
+         continue;
+      }
+      char hash[9];
+      snprintf(hash, sizeof(hash), "%08x", (unsigned)record.name_hash);
+      json_t *entry = json_object();
+      json_object_set_new(entry, "time", json_real(offset_ms + (double)record.time_ns / 1e6));
+      if (record.kind == FLIGHT_REQUEST) {
+         json_object_set_new(entry, "type", json_string("request"));
+         json_object_set_new(entry, "conn", json_integer(record.conn_id));
+         json_object_set_new(entry, "method",
+            json_string(method_name(record.code)));
+      } else {
+         json_object_set_new(entry, "type", json_string("event"));
+         json_object_set_new(entry, "event", json_string(event_type_to_string((rbusEventType_t)record.code)));
+      }
+      json_object_set_new(entry, "nameHash", json_string(hash));
+      json_object_set_new(entry, "durationUs", json_integer(record.duration_us));
+      json_object_set_new(entry, "status", json_integer(record.status));
+      json_array_append_new(records, entry);
+   }
+   return records;
+}
+
+// Write the flight recorder to flight_recorder_file, or stderr, one record per line (SIGUSR1)
+static void dump_flight_recorder(void) {
+   FILE *out = flight_recorder_file ? fopen(flight_recorder_file, "w") : stderr;
+   if (!out) {
+      lwsl_err("Cannot open flight recorder file %s: %s\n", flight_recorder_file, strerror(errno));
+      return;
+   }
+   json_t *records = flight_recorder_to_json(SIZE_MAX);
+   size_t index;
+   json_t *record;
+   json_array_foreach(records, index, record) {
+      char *line = json_dumps(record, JSON_COMPACT);
+      if (line) {
+         fprintf(out, "%s\n", line);
+         free(line);
+      }
+   }
+   json_decref(records);
+   if (out != stderr) {
+      fclose(out);
+   }
+}
+
+// Return the flight recorder's records, oldest first. {"limit": n} returns only the newest n.
+static json_t *handle_flight_recorder(json_t *params, json_t *id, struct lws *wsi) {
+   (void)wsi;
+   json_t *limit = json_object_get(params, "limit");
+   if (limit && (!json_is_integer(limit) || json_integer_value(limit) < 0)) {
+      return create_error_response(-32602, "Invalid params: limit must be a non-negative integer", id);
+   }
+   json_t *result = json_object();
+   json_object_set_new(result, "records",
+      flight_recorder_to_json(limit ? (size_t)json_integer_value(limit) : SIZE_MAX));
+   return create_success_response(result, id);
+}
+
+// Summarise a histogram in microseconds
+static json_t *histogram_to_json(Histogram *h) {
+   uint64_t total = atomic_load(&h->total);
+   json_t *stats = json_object();
+   json_object_set_new(stats, "count", json_integer((json_int_t)total));
+   json_object_set_new(stats, "mean_us", json_real(total ? (double)atomic_load(&h->sum_ns) / (double)total / 1e3 : 0));
+   json_object_set_new(stats, "p50_us", json_real((double)histogram_percentile(h, 0.5) / 1e3));
+   json_object_set_new(stats, "p90_us", json_real((double)histogram_percentile(h, 0.9) / 1e3));
+   json_object_set_new(stats, "p99_us", json_real((double)histogram_percentile(h, 0.99) / 1e3));
+   json_object_set_new(stats, "p999_us", json_real((double)histogram_percentile(h, 0.999) / 1e3));
+   json_object_set_new(stats, "max_us", json_real((double)atomic_load(&h->max_ns) / 1e3));
+   return stats;
+}
+
+// Per-method, per-path-prefix phase latencies, and event delivery latencies.
+// {"reset": true} clears the request histograms after reading.
+static json_t *handle_server_stats(json_t *params, json_t *id, struct lws *wsi) {
+   (void)wsi;
+   bool reset = json_is_true(json_object_get(params, "reset"));
+
+   json_t *prefixes = json_array();
+   for (int i = 0; i < stats_prefix_count; i++) {
+      json_array_append_new(prefixes, json_string(stats_prefixes[i]));
+   }
+
+   json_t *methods_json = json_object();
+   for (size_t m = 0; m < METRIC_METHOD_COUNT; m++) {
+      json_t *by_prefix = NULL;
+      for (int p = 0; p <= stats_prefix_count; p++) {
+         StatsCell *cell = atomic_load(&stats_cells[m][p]);
+         if (!cell || atomic_load(&cell->phases[STATS_TOTAL].total) == 0) {
+            continue;
+         }
+
+         json_t *phases = json_object();
+         for (int phase = 0; phase < STATS_PHASE_COUNT; phase++) {
+            if (atomic_load(&cell->phases[phase].total) > 0) {
+               json_object_set_new(phases, stats_phase_names[phase], histogram_to_json(&cell->phases[phase]));
+            }
+            if (reset) {
+               histogram_reset(&cell->phases[phase]);
+            }
+         }
+         if (!by_prefix) {
+            by_prefix = json_object();
+         }
+         json_object_set_new(by_prefix, p < stats_prefix_count ? stats_prefixes[p] : "other", phases);
+      }
+      if (by_prefix) {
+         json_object_set_new(methods_json, method_name(m), by_prefix);
+      }
+   }
+
+   // Event stages are also exported on /metrics, whose counts must never go
+   // down, so reset leaves them alone
+   json_t *events = json_object();
+   for (int stage = 0; stage < EVENT_STAGE_COUNT; stage++) {
+      json_object_set_new(events, event_stage_names[stage], histogram_to_json(&event_stages[stage]));
+   }
+
+   json_t *result = json_object();
+   json_object_set_new(result, "prefixes", prefixes);
+   json_object_set_new(result, "methods", methods_json);
+   json_object_set_new(result, "events", events);
+   return create_success_response(result, id);
+}
+
+// Handle one request. wsi is the client's WebSocket, or NULL for transports
+// without a session.
+static json_t *handle_jsonrpc_request(json_t *request, struct lws *wsi) {
+   json_t *id = json_object_get(request, "id");
+   const char *method = json_string_value(json_object_get(request, "method"));
+   json_t *params = json_object_get(request, "params");
+
+   if (!method || !params) {
+      return create_error_response(-32600, "Invalid Request", id);
+   }
+   const MethodDescriptor *descriptor = find_method(method);
+   int method_index = count_request(descriptor);
+   if (current_trace) {
+      // For a list of paths, the first one
+      json_t *path_json = json_object_get(params, "path");
+      const char *path = json_string_value(json_is_array(path_json) ? json_array_get(path_json, 0) : path_json);
+      current_trace->method = method_index;
+      current_trace->method_name = method;
+      current_trace->path = path ? path : json_string_value(json_object_get(params, "eventName"));
+   }
+
+   if (!descriptor) {
+      return create_error_response(-32601, "Method not found", id);
+   }
+   if (!wsi && (descriptor->flags & METHOD_SESSION)) {
+      return create_error_response(-32601, "Method requires a WebSocket session", id);
+   }
+
+   bool arena = arena_enable(false);
+   arena_enable(arena && !(descriptor->flags & METHOD_HEAP));
+   json_t *response = descriptor->handler(params, id, wsi);
+   arena_enable(arena);
+   return response;
+}
+
+// Record a finished request in the stats, the slow request log and the flight
+// recorder
+static void finish_request_trace(RequestTrace *trace, int64_t start_ns, json_t *response) {
+   trace->phase_ns[STATS_TOTAL] = monotonic_ns() - start_ns;
+   record_request_trace(trace);
+   log_slow_request(trace);
+   json_t *error_code = json_object_get(json_object_get(response, "error"), "code");
+   flight_record(FLIGHT_REQUEST, (uint16_t)(trace->method >= 0 ? trace->method : (int)METRIC_METHOD_COUNT - 1),
+      (uint32_t)trace->conn_id, trace->path, start_ns, start_ns + trace->phase_ns[STATS_TOTAL],
+      (int32_t)json_integer_value(error_code));
+}
+
+// Response to a message that is not valid JSON
+static json_t *parse_error_response(unsigned long conn_id, int64_t start_ns) {
+   json_t *response = create_error_response(-32700, "Parse error", NULL);
+   count_response_error(response);
+   flight_record(FLIGHT_REQUEST, METRIC_METHOD_COUNT - 1, (uint32_t)conn_id, NULL, start_ns, monotonic_ns(), -32700);
+   return response;
+}
+
+// A notification is a well-formed request without an id. In a batch or over
+// HTTP it is handled like any other request but not answered, not even with an
+// error. Malformed messages without an id are still answered with Invalid Request.
+static bool is_notification(json_t *request) {
+   return json_is_object(request) && !json_object_get(request, "id") &&
+      json_is_string(json_object_get(request, "method"));
+}
+
+// Handle a batch: an array of requests, each handled and traced on its own.
+// Notifications get no response, so the result is NULL when there is nothing
+// to send back.
+static json_t *handle_jsonrpc_batch(json_t *batch, struct lws *wsi, unsigned long conn_id) {
+   if (json_array_size(batch) == 0) {
+      json_t *response = create_error_response(-32600, "Invalid Request", NULL);
+      count_response_error(response);
+      return response;
+   }
+
+   json_t *responses = json_array();
+   size_t index;
+   json_t *request;
+   json_array_foreach(batch, index, request) {
+      RequestTrace trace = { .method = -1, .conn_id = conn_id };
+      int64_t start_ns = monotonic_ns();
+      current_trace = &trace;
+      in_batch = true;
+      json_t *response = handle_jsonrpc_request(request, wsi);
+      in_batch = false;
+      current_trace = NULL;
+      count_response_error(response);
+      finish_request_trace(&trace, start_ns, response);
+      if (!response) {
+         // Deferred, e.g. a snapshot subscribe: answered on its own later
+         continue;
+      }
+      if (is_notification(request)) {
+         json_decref(response);
+      } else {
+         json_array_append_new(responses, response);
+      }
+   }
+   if (json_array_size(responses) == 0) {
+      json_decref(responses);
+      return NULL;
+   }
+   return responses;
+}
+
+// Read configuration from JSON file
+static int read_config(const char *filename, struct lws_context_creation_info *info) {
+   json_t *root;
+   json_error_t error;
+
+   // Initialize defaults
+   info->port = 8080;
+   info->vhost_name = "localhost";
+   info->options = 0;
+
+   // Load JSON file
+   root = json_load_file(filename, 0, &error);
+   if (!root) {
+      fprintf(stderr, "Warning: Failed to load config file %s: %s\n", filename, error.text);
+      return -1;
+   }
+
+   // Parse host
+   json_t *host = json_object_get(root, "host");
+   if (json_is_string(host)) {
+      info->vhost_name = strdup(json_string_value(host));
+      if (!info->vhost_name) {
+         fprintf(stderr, "Error: Failed to allocate memory for host\n");
+         json_decref(root);
+         return -1;
+      }
+   }
+
+   // Parse port
+   json_t *port = json_object_get(root, "port");
+   if (json_is_integer(port)) {
+      info->port = (int)json_integer_value(port);
+      if (info->port < 0 || info->port > 65535) {
+         fprintf(stderr, "Warning: Invalid port %d in config, using default 8080\n", info->port);
+         info->port = 8080;
+      }
+   }
+
+   // Parse ssl_enabled
+   json_t *ssl_enabled = json_object_get(root, "ssl_enabled");
+   if (json_is_boolean(ssl_enabled)) {
+      if (json_is_true(ssl_enabled)) {
+         info->options |= LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
+      }
+   }
+
+   // Parse stats_path_prefixes (path prefixes server_stats buckets requests by)
+   json_t *prefixes = json_object_get(root, "stats_path_prefixes");
+   if (json_is_array(prefixes)) {
+      size_t index;
+      json_t *prefix;
+      json_array_foreach(prefixes, index, prefix) {
+         if (!json_is_string(prefix) || stats_prefix_count >= MAX_STATS_PREFIXES) {
+            fprintf(stderr, "Warning: Ignoring stats_path_prefixes entry %zu in config\n", index);
+            continue;
+         }
+         stats_prefixes[stats_prefix_count] = strdup(json_string_value(prefix));
+         if (stats_prefixes[stats_prefix_count]) {
+            stats_prefix_count++;
+         }
+      }
+   }
+
+   // Parse session_grace_period (seconds a dropped client's session is kept)
+   json_t *grace = json_object_get(root, "session_grace_period");
+   if (json_is_integer(grace)) {
+      session_grace_secs = (int)json_integer_value(grace);
+      if (session_grace_secs < 0 || session_grace_secs > 3600) {
+         fprintf(stderr, "Warning: Invalid session_grace_period %d in config, using default %d\n",
+            session_grace_secs, DEFAULT_SESSION_GRACE_SECS);
+         session_grace_secs = DEFAULT_SESSION_GRACE_SECS;
+      }
+   }
+
+   // Parse replay_buffer_size (events kept per session for resume)
+   json_t *replay = json_object_get(root, "replay_buffer_size");
+   if (json_is_integer(replay)) {
+      replay_buffer_size = (int)json_integer_value(replay);
+      if (replay_buffer_size < 0 || replay_buffer_size > 65536) {
+         fprintf(stderr, "Warning: Invalid replay_buffer_size %d in config, using default %d\n",
+            replay_buffer_size, DEFAULT_REPLAY_BUFFER_SIZE);
+         replay_buffer_size = DEFAULT_REPLAY_BUFFER_SIZE;
+      }
+   }
+
+   // Parse event_timestamps (add receivedAt to rbus_event params)
+   json_t *timestamps = json_object_get(root, "event_timestamps");
+   if (json_is_boolean(timestamps)) {
+      event_timestamps = json_is_true(timestamps);
+   }
+
+   // Parse slow_request_ms (requests slower than this are logged, 0 disables)
+   json_t *slow = json_object_get(root, "slow_request_ms");
+   if (json_is_integer(slow)) {
+      slow_request_ms = (int)json_integer_value(slow);
+      if (slow_request_ms < 0) {
+         fprintf(stderr, "Warning: Invalid slow_request_ms %d in config, using default %d\n",
+            slow_request_ms, DEFAULT_SLOW_REQUEST_MS);
+         slow_request_ms = DEFAULT_SLOW_REQUEST_MS;
+      }
+   }
+
+   // Parse slow_request_log_rate (slow-request log lines per second)
+   json_t *log_rate = json_object_get(root, "slow_request_log_rate");
+   if (json_is_integer(log_rate)) {
+      slow_request_log_rate = (int)json_integer_value(log_rate);
+      if (slow_request_log_rate < 1) {
+         fprintf(stderr, "Warning: Invalid slow_request_log_rate %d in config, using default %d\n",
+            slow_request_log_rate, DEFAULT_SLOW_REQUEST_LOG_RATE);
+         slow_request_log_rate = DEFAULT_SLOW_REQUEST_LOG_RATE;
+      }
+   }
+
+   // Parse flight_recorder_size (operations kept, 0 disables)
+   json_t *flight_size = json_object_get(root, "flight_recorder_size");
+   if (json_is_integer(flight_size)) {
+      flight_recorder_size = (int)json_integer_value(flight_size);
+      if (flight_recorder_size < 0 || flight_recorder_size > 1048576) {
+         fprintf(stderr, "Warning: Invalid flight_recorder_size %d in config, using default %d\n",
+            flight_recorder_size, DEFAULT_FLIGHT_RECORDER_SIZE);
+         flight_recorder_size = DEFAULT_FLIGHT_RECORDER_SIZE;
+      }
+   }
+
+   // Parse request_arena_size (initial bytes of the per-request arena, 0 disables)
+   json_t *arena_size = json_object_get(root, "request_arena_size");
+   if (json_is_integer(arena_size)) {
+      request_arena_size = (int)json_integer_value(arena_size);
+      if (request_arena_size < 0 || request_arena_size > 1048576) {
+         fprintf(stderr, "Warning: Invalid request_arena_size %d in config, using default %d\n",
+            request_arena_size, DEFAULT_REQUEST_ARENA_SIZE);
+         request_arena_size = DEFAULT_REQUEST_ARENA_SIZE;
+      }
+   }
+
+   // Parse flight_recorder_file (where SIGUSR1 dumps the flight recorder)
+   json_t *flight_file = json_object_get(root, "flight_recorder_file");
+   if (json_is_string(flight_file)) {
+      flight_recorder_file = strdup(json_string_value(flight_file));
+   }
+
+   // Parse capture_file (record inbound frames and responses for replay)
+   json_t *capture = json_object_get(root, "capture_file");
+   if (json_is_string(capture)) {
+      capture_file = strdup(json_string_value(capture));
+   }
+
+   // Parse unix_socket (path of an additional Unix domain socket listener)
+   json_t *unix_path = json_object_get(root, "unix_socket");
+   if (json_is_string(unix_path)) {
+      unix_socket = strdup(json_string_value(unix_path));
+   }
+
+   // Parse unix_socket_mode (octal permission bits of the socket file, e.g. "0660")
+   json_t *unix_mode = json_object_get(root, "unix_socket_mode");
+   if (json_is_string(unix_mode)) {
+      char *end;
+      long mode = strtol(json_string_value(unix_mode), &end, 8);
+      if (*end || mode < 0 || mode > 0777) {
+         fprintf(stderr, "Warning: Invalid unix_socket_mode %s in config, using default %04o\n",
+            json_string_value(unix_mode), DEFAULT_UNIX_SOCKET_MODE);
+      } else {
+         unix_socket_mode = (mode_t)mode;
+      }
+   }
+
+   // Parse tcp_enabled (false listens on unix_socket only)
+   json_t *tcp = json_object_get(root, "tcp_enabled");
+   if (json_is_boolean(tcp)) {
+      tcp_enabled = json_is_true(tcp);
+   }
+
+   // Parse raw_tcp_port (newline-delimited JSON-RPC listener, 0 disables it)
+   json_t *raw_port = json_object_get(root, "raw_tcp_port");
+   if (json_is_integer(raw_port)) {
+      raw_tcp_port = (int)json_integer_value(raw_port);
+      if (raw_tcp_port < 0 || raw_tcp_port > 65535) {
+         fprintf(stderr, "Warning: Invalid raw_tcp_port %d in config, using default 0\n", raw_tcp_port);
+         raw_tcp_port = 0;
+      }
+   }
+
+   // Parse capture_max_bytes (capture stops once the file reaches this size)
+   json_t *capture_max = json_object_get(root, "capture_max_bytes");
+   if (json_is_integer(capture_max)) {
+      capture_max_bytes = json_integer_value(capture_max);
+      if (capture_max_bytes <= 0) {
+         fprintf(stderr, "Warning: Invalid capture_max_bytes %lld in config, using default %lld\n",
+            capture_max_bytes, DEFAULT_CAPTURE_MAX_BYTES);
+         capture_max_bytes = DEFAULT_CAPTURE_MAX_BYTES;
+      }
+   }
+
+   json_decref(root);
+   return 0;
+}
+
+// Handle one JSON-RPC message, a request or a batch, received on a WebSocket or
+// raw socket connection and write the response back
+static void handle_message(Connection *conn, const char *in, size_t len) {
+   struct lws *wsi = conn->wsi;
+   RequestTrace trace = { .method = -1, .conn_id = conn->id };
+   int64_t start_ns = monotonic_ns();
+   capture_frame(CAPTURE_INBOUND, trace.conn_id, in, len);
+   // Everything allocated from here to the end of the response goes to the
+   // request arena (see handle_jsonrpc_request for the exceptions)
+   arena_enable(request_arena_size > 0);
+
+   // Parse straight from the lws buffer, which is not NUL-terminated
+   json_error_t error;
+   json_t *request = json_loadb(in, len, 0, &error);
+   trace.phase_ns[STATS_PARSE] = monotonic_ns() - start_ns;
+
+   json_t *response;
+   bool batch = json_is_array(request);
+   if (!request) {
+      response = parse_error_response(trace.conn_id, start_ns);
+   } else if (batch) {
+      response = handle_jsonrpc_batch(request, wsi, trace.conn_id);
+   } else {
+      current_trace = &trace;
+      response = handle_jsonrpc_request(request, wsi);
+      current_trace = NULL;
+      count_response_error(response);
+   }
+
+   if (response) {
+      int64_t phase_start_ns = monotonic_ns();
+      size_t response_len = connection_dump(conn, response);
+      trace.phase_ns[STATS_SERIALIZE] = monotonic_ns() - phase_start_ns;
+      if (response_len > 0) {
+         capture_frame(CAPTURE_RESPONSE, trace.conn_id, conn->send.data + LWS_PRE, response_len);
+         phase_start_ns = monotonic_ns();
+         if (send_buffer_write(&conn->send, wsi, response_len, connection_write_protocol(conn)) >= 0) {
+            metric_add(&metrics.bytes_sent, response_len);
+         }
+         trace.phase_ns[STATS_WRITE] = monotonic_ns() - phase_start_ns;
+      } else {
+         send_serialization_failed(conn);
+      }
+   }
+   // Batch elements and parse errors are recorded as they are handled
+   if (request && !batch) {
+      finish_request_trace(&trace, start_ns, response);
+   }
+   json_decref(request);
+   json_decref(response);
+   arena_enable(false);
+   arena_reset(&request_arena);
+}
+
+// WebSocket handling
+static int callback_jsonrpc(struct lws *wsi, enum lws_callback_reasons reason,
+   void *user, void *in, size_t len) {
+   switch (reason) {
+   case LWS_CALLBACK_RECEIVE: {
+      handle_message((Connection *)user, in, len);
+      break;
+   }
+   case LWS_CALLBACK_ESTABLISHED: {
+      Connection *conn = (Connection *)user;
+      if (connection_open(conn, wsi, TRANSPORT_WEBSOCKET) != 0) {
+         return -1;
+      }
+      capture_frame(CAPTURE_OPEN, conn->id, NULL, 0);
+      break;
+   }
+   case LWS_CALLBACK_SERVER_WRITEABLE: {
+      write_pending_events((Connection *)user);
+      break;
+   }
+   case LWS_CALLBACK_TIMER: {
+      connection_timer((Connection *)user);
+      break;
+   }
+   case LWS_CALLBACK_EVENT_WAIT_CANCELLED: {
+      schedule_pending_events();
+      break;
+   }
+   case LWS_CALLBACK_CLOSED: {
+      Connection *conn = (Connection *)user;
+      capture_frame(CAPTURE_CLOSE, conn->id, NULL, 0);
+      connection_close(conn);
+      break;
+   }
+   default:
+      break;
+   }
+
+   return 0;
+}
+
+// Buffered HTTP response body, stored in the lws per-session user data
+typedef struct {
+   char *buffer; // LWS_PRE bytes of headroom followed by the body
+   size_t len;   // Body length
+} HttpResponse;
+
+// State of one POST /jsonrpc exchange, stored in the lws per-session user data.
+// The reply buffer is kept for the next request on a keep-alive connection.
+typedef struct {
+   char *body;       // Request body received so far
+   size_t body_len;
+   SendBuffer reply; // Serialized response
+   size_t reply_len; // Bytes of reply waiting to be written
+} HttpRpc;
+
+#define HTTP_RPC_MAX_BODY (1024 * 1024)
+
+// Render the Prometheus text exposition into a buffer with LWS_PRE headroom
+static char *render_metrics(size_t *len) {
+   char *buffer = NULL;
+   size_t size = 0;
+   FILE *out = open_memstream(&buffer, &size);
+   if (!out) {
+      return NULL;
+   }
+   fprintf(out, "%*s", (int)LWS_PRE, "");
+
+   fprintf(out, "# HELP rbus_jsonrpc_requests_total JSON-RPC requests by method.\n");
+   fprintf(out, "# TYPE rbus_jsonrpc_requests_total counter\n");
+   for (size_t i = 0; i < METRIC_METHOD_COUNT; i++) {
+      fprintf(out, "rbus_jsonrpc_requests_total{method=\"%s\"} %llu\n", method_name(i),
+         (unsigned long long)atomic_load(&metrics.requests[i]));
+   }
+
+   fprintf(out, "# HELP rbus_jsonrpc_errors_total JSON-RPC error responses by code.\n");
+   fprintf(out, "# TYPE rbus_jsonrpc_errors_total counter\n");
+   for (size_t i = 0; i <= METRIC_ERROR_CODE_COUNT; i++) {
+      char code[16];
+      if (i < METRIC_ERROR_CODE_COUNT) {
+         snprintf(code, sizeof(code), "%d", metric_error_codes[i]);
+      } else {
+         snprintf(code, sizeof(code), "other");
+      }
+      fprintf(out, "rbus_jsonrpc_errors_total{code=\"%s\"} %llu\n", code,
+         (unsigned long long)atomic_load(&metrics.errors[i]));
+   }
+
+   int session_count = 0;
+   size_t queued = 0;
+   pthread_mutex_lock(&event_lock);
+   int subscription_total = subscription_count;
+   for (Session *session = sessions; session; session = session->next) {
+      session_count++;
+   }
+   for (Connection *conn = connections; conn; conn = conn->next) {
+      queued += json_array_size(conn->pending) + json_array_size(conn->batch);
+   }
+   pthread_mutex_unlock(&event_lock);
+
+   fprintf(out, "# HELP rbus_jsonrpc_connections Open WebSocket, SSE and raw TCP connections.\n");
+   fprintf(out, "# TYPE rbus_jsonrpc_connections gauge\n");
+   fprintf(out, "rbus_jsonrpc_connections %d\n", atomic_load(&metrics.connections));
+   fprintf(out, "# HELP rbus_jsonrpc_sessions Sessions, including detached ones awaiting resume.\n");
+   fprintf(out, "# TYPE rbus_jsonrpc_sessions gauge\n");
+   fprintf(out, "rbus_jsonrpc_sessions %d\n", session_count);
+   fprintf(out, "# HELP rbus_jsonrpc_subscriptions Subscription table entries.\n");
+   fprintf(out, "# TYPE rbus_jsonrpc_subscriptions gauge\n");
+   fprintf(out, "rbus_jsonrpc_subscriptions %d\n", subscription_total);
+   fprintf(out, "# HELP rbus_jsonrpc_interned_names Distinct event names held by subscriptions.\n");
+   fprintf(out, "# TYPE rbus_jsonrpc_interned_names gauge\n");
+   fprintf(out, "rbus_jsonrpc_interned_names %zu\n", intern_count());
+   fprintf(out, "# HELP rbus_jsonrpc_outbound_queue_events Events queued for writing to clients.\n");
+   fprintf(out, "# TYPE rbus_jsonrpc_outbound_queue_events gauge\n");
+   fprintf(out, "rbus_jsonrpc_outbound_queue_events %zu\n", queued);
+
+   fprintf(out, "# HELP rbus_jsonrpc_events_received_total Events delivered by rbus.\n");
+   fprintf(out, "# TYPE rbus_jsonrpc_events_received_total counter\n");
+   fprintf(out, "rbus_jsonrpc_events_received_total %llu\n",
+      (unsigned long long)atomic_load(&metrics.events_received));
+   fprintf(out, "# HELP rbus_jsonrpc_events_sent_total Events written to clients.\n");
+   fprintf(out, "# TYPE rbus_jsonrpc_events_sent_total counter\n");
+   fprintf(out, "rbus_jsonrpc_events_sent_total %llu\n", (unsigned long long)atomic_load(&metrics.events_sent));
+   fprintf(out, "# HELP rbus_jsonrpc_events_dropped_total Events dropped because a client queue was full.\n");
+   fprintf(out, "# TYPE rbus_jsonrpc_events_dropped_total counter\n");
+   fprintf(out, "rbus_jsonrpc_events_dropped_total %llu\n",
+      (unsigned long long)atomic_load(&metrics.events_dropped));
+   fprintf(out, "# HELP rbus_jsonrpc_slow_requests_total Requests slower than slow_request_ms.\n");
+   fprintf(out, "# TYPE rbus_jsonrpc_slow_requests_total counter\n");
+   fprintf(out, "rbus_jsonrpc_slow_requests_total %llu\n", (unsigned long long)atomic_load(&metrics.slow_requests));
+   fprintf(out, "# HELP rbus_jsonrpc_sent_bytes_total Response and event payload bytes written on all transports.\n");
+   fprintf(out, "# TYPE rbus_jsonrpc_sent_bytes_total counter\n");
+   fprintf(out, "rbus_jsonrpc_sent_bytes_total %llu\n", (unsigned long long)atomic_load(&metrics.bytes_sent));
+
+   fprintf(out, "# HELP rbus_jsonrpc_rbus_call_seconds Latency of rbus calls by operation.\n");
+   fprintf(out, "# TYPE rbus_jsonrpc_rbus_call_seconds histogram\n");
+   for (int op = 0; op < RBUS_OP_COUNT; op++) {
+      uint64_t cumulative = 0;
+      for (size_t b = 0; b <= RBUS_LATENCY_BUCKET_COUNT; b++) {
+         cumulative += atomic_load(&metrics.rbus_calls[op][b]);
+         if (b < RBUS_LATENCY_BUCKET_COUNT) {
+            fprintf(out, "rbus_jsonrpc_rbus_call_seconds_bucket{op=\"%s\",le=\"%g\"} %llu\n",
+               rbus_op_names[op], rbus_latency_buckets[b], (unsigned long long)cumulative);
+         } else {
+            fprintf(out, "rbus_jsonrpc_rbus_call_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n",
+               rbus_op_names[op], (unsigned long long)cumulative);
          }
-         subscription_count--;
       }
+      fprintf(out, "rbus_jsonrpc_rbus_call_seconds_sum{op=\"%s\"} %.9f\n", rbus_op_names[op],
+         (double)atomic_load(&metrics.rbus_call_ns[op]) / 1e9);
+      fprintf(out, "rbus_jsonrpc_rbus_call_seconds_count{op=\"%s\"} %llu\n", rbus_op_names[op],
+         (unsigned long long)cumulative);
    }
-}
-
-// JSON-RPC handling
-static json_t *create_error_response(int code, const char *message, json_t *id) {
-   json_t *response = json_object();
-   json_object_set_new(response, "jsonrpc", json_string("2.0"));
 
-   json_t *error = json_object();
-   json_object_set_new(error, "code", json_integer(code));
-   json_object_set_new(error, "message", json_string(message));
-   json_object_set_new(response, "error", error);
+   static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+   fprintf(out, "# HELP rbus_jsonrpc_event_delivery_seconds Event delivery latency by stage.\n");
+   fprintf(out, "# TYPE rbus_jsonrpc_event_delivery_seconds summary\n");
+   for (int stage = 0; stage < EVENT_STAGE_COUNT; stage++) {
+      Histogram *h = &event_stages[stage];
+      for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+         fprintf(out, "rbus_jsonrpc_event_delivery_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n",
+            event_stage_names[stage], quantiles[q], (double)histogram_percentile(h, quantiles[q]) / 1e9);
+      }
+      fprintf(out, "rbus_jsonrpc_event_delivery_seconds_sum{stage=\"%s\"} %.9f\n", event_stage_names[stage],
+         (double)atomic_load(&h->sum_ns) / 1e9);
+      fprintf(out, "rbus_jsonrpc_event_delivery_seconds_count{stage=\"%s\"} %llu\n", event_stage_names[stage],
+         (unsigned long long)atomic_load(&h->total));
+   }
 
-   json_object_set(response, "id", id ? json_incref(id) : json_null());
-   return response;
+   if (fclose(out) != 0 || !buffer) {
+      free(buffer);
+      return NULL;
+   }
+   *len = size - LWS_PRE;
+   return buffer;
 }
 
-static json_t *create_success_response(json_t *result, json_t *id) {
-   json_t *response = json_object();
-   json_object_set_new(response, "jsonrpc", json_string("2.0"));
-   json_object_set_new(response, "result", result);
-   json_object_set(response, "id", id ? json_incref(id) : json_null());
-   return response;
-}
+// HTTP handling for /metrics, bound through an lws callback mount
+static int callback_metrics(struct lws *wsi, enum lws_callback_reasons reason,
+   void *user, void *in, size_t len) {
+   HttpResponse *response = (HttpResponse *)user;
 
-static json_t *handle_rbus_get(json_t *params, json_t *id) {
-   const char *path = json_string_value(json_object_get(params, "path"));
-   if (!path) {
-      return create_error_response(-32602, "Invalid params", id);
-   }
+   switch (reason) {
+   case LWS_CALLBACK_HTTP: {
+      unsigned char headers[LWS_PRE + 256];
+      unsigned char *start = &headers[LWS_PRE];
+      unsigned char *p = start;
+      unsigned char *end = &headers[sizeof(headers) - 1];
+
+      response->buffer = render_metrics(&response->len);
+      if (!response->buffer) {
+         lws_return_http_status(wsi, HTTP_STATUS_INTERNAL_SERVER_ERROR, NULL);
+         return -1;
+      }
 
-   json_t *value = rbus_get_value(g_rbusHandle, path);
-   if (json_is_object(value) && json_object_get(value, "error")) {
-      return value;
+      if (lws_add_http_common_headers(wsi, HTTP_STATUS_OK, "text/plain; version=0.0.4",
+            response->len, &p, end) ||
+         lws_finalize_write_http_header(wsi, start, &p, end)) {
+         return 1;
+      }
+      lws_callback_on_writable(wsi);
+      return 0;
+   }
+   case LWS_CALLBACK_HTTP_WRITEABLE: {
+      if (!response->buffer) {
+         break;
+      }
+      int written = lws_write(wsi, (unsigned char *)response->buffer + LWS_PRE, response->len, LWS_WRITE_HTTP_FINAL);
+      free(response->buffer);
+      response->buffer = NULL;
+      if (written < 0 || lws_http_transaction_completed(wsi)) {
+         return -1;
+      }
+      return 0;
+   }
+   case LWS_CALLBACK_CLOSED_HTTP: {
+      free(response->buffer);
+      response->buffer = NULL;
+      break;
+   }
+   default:
+      break;
    }
 
-   return create_success_response(value, id);
+   return lws_callback_http_dummy(wsi, reason, user, in, len);
 }
 
-static json_t *handle_rbus_set(json_t *params, json_t *id) {
-   const char *path = json_string_value(json_object_get(params, "path"));
-   json_t *value = json_object_get(params, "value");
-   if (!path || !value) {
-      return create_error_response(-32602, "Invalid params", id);
+// Handle the request body collected for POST /jsonrpc and queue the response.
+// The exchange is not captured: rbus_jsonrpc_replay replays over WebSocket,
+// where methods that need a session would succeed instead of failing.
+static int http_rpc_respond(struct lws *wsi, HttpRpc *rpc) {
+   RequestTrace trace = { .method = -1 };
+   int64_t start_ns = monotonic_ns();
+   arena_enable(request_arena_size > 0);
+
+   json_error_t error;
+   json_t *request = json_loadb(rpc->body, rpc->body_len, 0, &error);
+   trace.phase_ns[STATS_PARSE] = monotonic_ns() - start_ns;
+   rpc->body_len = 0;
+
+   // No WebSocket, so methods that need a session are refused
+   json_t *response;
+   bool batch = json_is_array(request);
+   if (!request) {
+      response = parse_error_response(0, start_ns);
+   } else if (batch) {
+      response = handle_jsonrpc_batch(request, NULL, 0);
+   } else {
+      current_trace = &trace;
+      response = handle_jsonrpc_request(request, NULL);
+      current_trace = NULL;
+      count_response_error(response);
    }
 
-   if (rbus_set_value(g_rbusHandle, path, value) != 0) {
-      return create_error_response(-32000, "Set failed", id);
+   // A notification is traced like any request but not answered. Unlike on a
+   // WebSocket, this holds for a lone one too: HTTP has 204 for an empty reply.
+   bool answer = response && !is_notification(request);
+   int64_t phase_start_ns = monotonic_ns();
+   rpc->reply_len = answer ? send_buffer_dump(&rpc->reply, response) : 0;
+   trace.phase_ns[STATS_SERIALIZE] = monotonic_ns() - phase_start_ns;
+   if (request && !batch) {
+      finish_request_trace(&trace, start_ns, response);
+   }
+   bool failed = answer && rpc->reply_len == 0;
+   json_decref(request);
+   json_decref(response);
+   arena_enable(false);
+   arena_reset(&request_arena);
+
+   if (failed) {
+      lws_return_http_status(wsi, HTTP_STATUS_INTERNAL_SERVER_ERROR, NULL);
+      return -1;
    }
 
-   return create_success_response(json_true(), id);
+   unsigned char headers[LWS_PRE + 256];
+   unsigned char *start = &headers[LWS_PRE];
+   unsigned char *p = start;
+   unsigned char *end = &headers[sizeof(headers) - 1];
+   // A notification, or a batch of them, has no response body
+   if (lws_add_http_common_headers(wsi, rpc->reply_len ? HTTP_STATUS_OK : HTTP_STATUS_NO_CONTENT,
+         "application/json", rpc->reply_len, &p, end) ||
+      lws_finalize_write_http_header(wsi, start, &p, end)) {
+      return 1;
+   }
+   if (rpc->reply_len == 0) {
+      return lws_http_transaction_completed(wsi) ? -1 : 0;
+   }
+   lws_callback_on_writable(wsi);
+   return 0;
 }
 
-static json_t *handle_rbus_event_subscribe(json_t *params, json_t *id, struct lws *wsi) {
-   const char *eventName = json_string_value(json_object_get(params, "eventName"));
-   json_t *timeout_json = json_object_get(params, "timeout");
-   int timeout = timeout_json && json_is_integer(timeout_json) ? (int)json_integer_value(timeout_json) : 30;
+// HTTP handling for POST /jsonrpc: one request or batch per POST, answered in
+// the response body. The connection is kept alive for further requests.
+static int callback_http_jsonrpc(struct lws *wsi, enum lws_callback_reasons reason,
+   void *user, void *in, size_t len) {
+   HttpRpc *rpc = (HttpRpc *)user;
 
-   if (!eventName) {
-      return create_error_response(-32602, "Invalid params: eventName required", id);
+   switch (reason) {
+   case LWS_CALLBACK_HTTP:
+      if (!lws_hdr_total_length(wsi, WSI_TOKEN_POST_URI)) {
+         lws_return_http_status(wsi, HTTP_STATUS_METHOD_NOT_ALLOWED, NULL);
+         return -1;
+      }
+      rpc->body_len = 0;
+      return 0;
+   case LWS_CALLBACK_HTTP_BODY: {
+      if (len > HTTP_RPC_MAX_BODY - rpc->body_len) {
+         lws_return_http_status(wsi, HTTP_STATUS_REQ_ENTITY_TOO_LARGE, NULL);
+         return -1;
+      }
+      char *body = realloc(rpc->body, rpc->body_len + len);
+      if (!body) {
+         lws_return_http_status(wsi, HTTP_STATUS_INTERNAL_SERVER_ERROR, NULL);
+         return -1;
+      }
+      memcpy(body + rpc->body_len, in, len);
+      rpc->body = body;
+      rpc->body_len += len;
+      return 0;
    }
-
-   if (add_subscription(eventName, wsi) != 0) {
-      return create_error_response(-32000, "Subscription failed", id);
+   case LWS_CALLBACK_HTTP_BODY_COMPLETION:
+      return http_rpc_respond(wsi, rpc);
+   case LWS_CALLBACK_HTTP_WRITEABLE: {
+      if (!rpc->reply_len) {
+         break;
+      }
+      int written = lws_write(wsi, rpc->reply.data + LWS_PRE, rpc->reply_len, LWS_WRITE_HTTP_FINAL);
+      if (written >= 0) {
+         metric_add(&metrics.bytes_sent, rpc->reply_len);
+      }
+      rpc->reply_len = 0;
+      if (rpc->reply.capacity > SEND_BUFFER_MAX_KEPT) {
+         send_buffer_free(&rpc->reply);
+      }
+      if (written < 0 || lws_http_transaction_completed(wsi)) {
+         return -1;
+      }
+      return 0;
+   }
+   case LWS_CALLBACK_HTTP_DROP_PROTOCOL:
+   case LWS_CALLBACK_CLOSED_HTTP:
+      free(rpc->body);
+      rpc->body = NULL;
+      rpc->body_len = 0;
+      rpc->reply_len = 0;
+      send_buffer_free(&rpc->reply);
+      break;
+   default:
+      break;
    }
 
-   return create_success_response(json_true(), id);
+   return lws_callback_http_dummy(wsi, reason, user, in, len);
 }
 
-static json_t *handle_rbus_event_unsubscribe(json_t *params, json_t *id, struct lws *wsi) {
-   const char *eventName = json_string_value(json_object_get(params, "eventName"));
-   if (!eventName) {
-      return create_error_response(-32602, "Invalid params: eventName required", id);
+// Split a Last-Event-ID, "<session id>:<seq>", in place. Returns false if malformed.
+static bool parse_last_event_id(char *text, const char **session_id, uint64_t *seq) {
+   char *colon = strrchr(text, ':');
+   if (!colon || colon == text) {
+      return false;
    }
-
-   if (remove_subscription(eventName, wsi) != 0) {
-      return create_error_response(-32000, "Unsubscription failed: not subscribed", id);
+   char *end;
+   errno = 0;
+   unsigned long long value = strtoull(colon + 1, &end, 10);
+   if (end == colon + 1 || *end || errno) {
+      return false;
    }
+   *colon = '\0';
+   *session_id = text;
+   *seq = value;
+   return true;
+}
 
-   return create_success_response(json_true(), id);
+// Queue a "session" event telling an SSE client which session it is on (lws thread)
+static void sse_announce_session(Connection *conn, bool resume_failed) {
+   pthread_mutex_lock(&event_lock);
+   if (stamp_push(&conn->pending_stamps, 0, 0)) {
+      json_t *params = json_object();
+      json_object_set_new(params, "sessionId", json_string(conn->session->id));
+      json_object_set_new(params, "seq", json_integer((json_int_t)conn->session->seq));
+      if (resume_failed) {
+         json_object_set_new(params, "replayed", json_integer(0));
+         json_object_set_new(params, "complete", json_false());
+      }
+      json_array_append_new(conn->pending, create_notification("session", params));
+   }
+   pthread_mutex_unlock(&event_lock);
+   lws_callback_on_writable(conn->wsi);
 }
 
-static json_t *handle_jsonrpc_request(json_t *request, struct lws *wsi) {
-   json_t *id = json_object_get(request, "id");
-   const char *method = json_string_value(json_object_get(request, "method"));
-   json_t *params = json_object_get(request, "params");
+// Open an SSE stream. The session named by Last-Event-ID (or the lastEventId
+// query argument, for clients that cannot set headers) is resumed if it is still
+// around, the comma-separated names in the subscribe argument are subscribed on
+// it, and events then follow through write_pending_events.
+static int sse_open(struct lws *wsi, Connection *conn) {
+   char names[4096];
+   if (!lws_get_urlarg_by_name(wsi, "subscribe=", names, sizeof(names))) {
+      lws_return_http_status(wsi, HTTP_STATUS_BAD_REQUEST, NULL);
+      return -1;
+   }
+   PathList list;
+   json_t *names_json = json_string(names);
+   int rc = path_list_init(&list, names_json);
+   // Which names this request subscribes, to undo only those if one fails
+   bool *added = rc == 0 && list.count > 0 ? calloc(list.count, sizeof(bool)) : NULL;
+   if (!added || connection_open(conn, wsi, TRANSPORT_SSE) != 0) {
+      free(added);
+      path_list_free(&list);
+      json_decref(names_json);
+      lws_return_http_status(wsi, rc != 0 || list.count == 0 ? HTTP_STATUS_BAD_REQUEST :
+         HTTP_STATUS_INTERNAL_SERVER_ERROR, NULL);
+      return -1;
+   }
 
-   if (!method || !params) {
-      return create_error_response(-32600, "Invalid Request", id);
+   char last_event_id[128];
+   const char *session_id;
+   uint64_t last_seq;
+   bool resume = (lws_hdr_custom_copy(wsi, last_event_id, sizeof(last_event_id), "last-event-id:", 14) > 0 ||
+      lws_get_urlarg_by_name(wsi, "lastEventId=", last_event_id, sizeof(last_event_id))) &&
+      parse_last_event_id(last_event_id, &session_id, &last_seq);
+   json_t *result = NULL;
+   if (resume && attach_session(conn, session_id, last_seq, true, &result) == NULL) {
+      json_decref(result);
+   } else {
+      sse_announce_session(conn, resume);
    }
 
-   if (strcmp(method, "rbus_get") == 0) {
-      return handle_rbus_get(params, id);
-   } else if (strcmp(method, "rbus_set") == 0) {
-      return handle_rbus_set(params, id);
-   } else if (strcmp(method, "rbusEvent_Subscribe") == 0) {
-      return handle_rbus_event_subscribe(params, id, wsi);
-   } else if (strcmp(method, "rbusEvent_Unsubscribe") == 0) {
-      return handle_rbus_event_unsubscribe(params, id, wsi);
+   // Plain options: SSE has no batching or filters
+   SubscribeOptions options = { .timeout = 30 };
+   for (int i = 0; i < list.count && rc == 0; i++) {
+      const char *name = list.paths[i];
+      if (is_wildcard(name)) {
+         added[i] = !find_wildcard(name, conn->session);
+         rc = add_wildcard(name, conn->session, &options);
+      } else {
+         pthread_mutex_lock(&event_lock);
+         added[i] = !find_subscription(name, conn->session);
+         pthread_mutex_unlock(&event_lock);
+         rc = add_subscription(name, conn->session, &options);
+      }
+   }
+   if (rc != 0) {
+      // Drop what this request subscribed, so a new session is not kept for a
+      // resume and a resumed one keeps only what it had. A failed name has
+      // already cleaned up after itself.
+      for (int i = 0; i < list.count; i++) {
+         if (added[i] && is_wildcard(list.paths[i])) {
+            remove_wildcard(list.paths[i], conn->session);
+         } else if (added[i]) {
+            remove_subscription(list.paths[i], conn->session);
+         }
+      }
+   }
+   free(added);
+   path_list_free(&list);
+   json_decref(names_json);
+   if (rc != 0) {
+      lws_return_http_status(wsi, HTTP_STATUS_BAD_REQUEST, NULL);
+      return -1;
    }
 
-   return create_error_response(-32601, "Method not found", id);
+   unsigned char headers[LWS_PRE + 256];
+   unsigned char *start = &headers[LWS_PRE];
+   unsigned char *p = start;
+   unsigned char *end = &headers[sizeof(headers) - 1];
+   if (lws_add_http_common_headers(wsi, HTTP_STATUS_OK, "text/event-stream", LWS_ILLEGAL_HTTP_CONTENT_LEN, &p, end) ||
+      lws_add_http_header_by_name(wsi, (const unsigned char *)"cache-control:", (const unsigned char *)"no-cache",
+         8, &p, end) ||
+      lws_finalize_write_http_header(wsi, start, &p, end)) {
+      return 1;
+   }
+   // The stream stays open until the client goes away
+   lws_set_timeout(wsi, NO_PENDING_TIMEOUT, 0);
+   return 0;
 }
 
-// Read configuration from JSON file
-static int read_config(const char *filename, struct lws_context_creation_info *info) {
-   json_t *root;
-   json_error_t error;
-
-   // Initialize defaults
-   info->port = 8080;
-   info->vhost_name = "localhost";
-   info->options = 0;
+// HTTP handling for GET /events: a read-only Server-Sent Events stream fed by
+// the same subscriptions and sessions as the WebSocket endpoint. The per-session
+// data is a Connection, live from sse_open until the stream closes.
+static int callback_sse(struct lws *wsi, enum lws_callback_reasons reason,
+   void *user, void *in, size_t len) {
+   Connection *conn = (Connection *)user;
 
-   // Load JSON file
-   root = json_load_file(filename, 0, &error);
-   if (!root) {
-      fprintf(stderr, "Warning: Failed to load config file %s: %s\n", filename, error.text);
-      return -1;
+   switch (reason) {
+   case LWS_CALLBACK_HTTP:
+      return sse_open(wsi, conn);
+   case LWS_CALLBACK_HTTP_WRITEABLE:
+      if (conn->pending) {
+         write_pending_events(conn);
+      }
+      return 0;
+   case LWS_CALLBACK_TIMER:
+      if (conn->pending) {
+         connection_timer(conn);
+      }
+      break;
+   case LWS_CALLBACK_HTTP_DROP_PROTOCOL:
+   case LWS_CALLBACK_CLOSED_HTTP:
+      if (conn->pending) {
+         connection_close(conn);
+      }
+      break;
+   default:
+      break;
    }
 
-   // Parse host
-   json_t *host = json_object_get(root, "host");
-   if (json_is_string(host)) {
-      info->vhost_name = strdup(json_string_value(host));
-      if (!info->vhost_name) {
-         fprintf(stderr, "Error: Failed to allocate memory for host\n");
-         json_decref(root);
-         return -1;
+   return lws_callback_http_dummy(wsi, reason, user, in, len);
+}
+
+// Handle the complete lines at the start of data as JSON-RPC messages, stopping
+// once the socket has output backed up. Returns the number of bytes used.
+static size_t raw_handle_lines(Connection *conn, const char *data, size_t len) {
+   size_t used = 0;
+   while (used < len && !lws_has_buffered_out(conn->wsi)) {
+      const char *line = data + used;
+      const char *newline = memchr(line, '\n', len - used);
+      if (!newline) {
+         break;
+      }
+      size_t line_len = (size_t)(newline - line);
+      used += line_len + 1;
+      if (line_len > 0 && line[line_len - 1] == '\r') {
+         line_len--;
+      }
+      // Blank lines are allowed as keepalives
+      if (line_len > 0) {
+         handle_message(conn, line, line_len);
       }
    }
+   return used;
+}
 
-   // Parse port
-   json_t *port = json_object_get(root, "port");
-   if (json_is_integer(port)) {
-      info->port = (int)json_integer_value(port);
-      if (info->port < 0 || info->port > 65535) {
-         fprintf(stderr, "Warning: Invalid port %d in config, using default 8080\n", info->port);
-         info->port = 8080;
+// Keep received bytes in conn->input. Returns false when out of memory.
+static bool raw_keep_input(Connection *conn, const char *in, size_t len) {
+   if (conn->input_len + len > conn->input_capacity) {
+      size_t capacity = conn->input_capacity ? conn->input_capacity : 1024;
+      while (capacity < conn->input_len + len) {
+         capacity *= 2;
+      }
+      char *input = realloc(conn->input, capacity);
+      if (!input) {
+         return false;
       }
+      conn->input = input;
+      conn->input_capacity = capacity;
    }
+   memcpy(conn->input + conn->input_len, in, len);
+   conn->input_len += len;
+   return true;
+}
 
-   // Parse ssl_enabled
-   json_t *ssl_enabled = json_object_get(root, "ssl_enabled");
-   if (json_is_boolean(ssl_enabled)) {
-      if (json_is_true(ssl_enabled)) {
-         info->options |= LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
-      }
+// Split raw socket input into lines and handle each one as a JSON-RPC message.
+// Complete lines are parsed in place. A line cut off at the end of a read, and
+// the lines after a response that could not be sent at once, are kept in
+// conn->input. While output is backed up, reading stops (lws rx flow control)
+// and the kept lines wait for the writeable callback, so a client that sends
+// requests without reading the responses cannot grow the send queue without
+// bound. Call with no data to resume. Returns -1 to drop the connection.
+static int raw_receive(Connection *conn, const char *in, size_t len) {
+   if (conn->input_len == 0 && !conn->rx_paused) {
+      size_t used = raw_handle_lines(conn, in, len);
+      in += used;
+      len -= used;
+   }
+   if (len > 0 && !raw_keep_input(conn, in, len)) {
+      return -1;
+   }
+   if (conn->input_len > 0 && !lws_has_buffered_out(conn->wsi)) {
+      size_t used = raw_handle_lines(conn, conn->input, conn->input_len);
+      memmove(conn->input, conn->input + used, conn->input_len - used);
+      conn->input_len -= used;
    }
 
-   json_decref(root);
+   bool backed_up = lws_has_buffered_out(conn->wsi);
+   // Unless output is backed up, what is left is part of one line
+   if (!backed_up && conn->input_len > RAW_MAX_LINE) {
+      lwsl_warn("Connection %lu sent a line over %d bytes, closing\n", conn->id, RAW_MAX_LINE);
+      return -1;
+   }
+   if (backed_up != conn->rx_paused) {
+      lws_rx_flow_control(conn->wsi, !backed_up);
+      conn->rx_paused = backed_up;
+   }
+   if (backed_up) {
+      lws_callback_on_writable(conn->wsi);
+   }
    return 0;
 }
 
-// WebSocket handling
-static int callback_jsonrpc(struct lws *wsi, enum lws_callback_reasons reason,
+// Raw TCP handling: newline-delimited JSON-RPC, one request or batch per line,
+// with responses and notifications written back one per line. Connections get
+// a session like WebSocket ones, so every method is available.
+static int callback_raw(struct lws *wsi, enum lws_callback_reasons reason,
    void *user, void *in, size_t len) {
+   Connection *conn = (Connection *)user;
+
    switch (reason) {
-   case LWS_CALLBACK_RECEIVE: {
-      char *buffer = malloc(len + 1);
-      if (!buffer) {
-         json_t *response = create_error_response(-32000, "Memory allocation failed", NULL);
-         char *response_str = json_dumps(response, JSON_COMPACT);
-         if (response_str) {
-            lws_write(wsi, (unsigned char *)response_str, strlen(response_str), LWS_WRITE_TEXT);
-            free(response_str);
-         }
-         json_decref(response);
+   case LWS_CALLBACK_RAW_ADOPT:
+      if (connection_open(conn, wsi, TRANSPORT_RAW) != 0) {
          return -1;
       }
-      memcpy(buffer, in, len);
-      buffer[len] = '\0';
-
-      json_error_t error;
-      json_t *request = json_loads(buffer, 0, &error);
-      free(buffer);
-
-      if (!request) {
-         json_t *response = create_error_response(-32700, "Parse error", NULL);
-         char *response_str = json_dumps(response, JSON_COMPACT);
-         if (response_str) {
-            lws_write(wsi, (unsigned char *)response_str, strlen(response_str), LWS_WRITE_TEXT);
-            free(response_str);
-         }
-         json_decref(response);
-         break;
+      capture_frame(CAPTURE_OPEN, conn->id, NULL, 0);
+      break;
+   case LWS_CALLBACK_RAW_RX:
+      return raw_receive(conn, in, len);
+   case LWS_CALLBACK_RAW_WRITEABLE:
+      // Output has drained: handle the lines held back and resume reading first
+      if (conn->rx_paused && raw_receive(conn, NULL, 0) != 0) {
+         return -1;
       }
-
-      json_t *response = handle_jsonrpc_request(request, wsi);
-      char *response_str = json_dumps(response, JSON_COMPACT);
-      if (response_str) {
-         lws_write(wsi, (unsigned char *)response_str, strlen(response_str), LWS_WRITE_TEXT);
-         free(response_str);
-      } else {
-         lws_write(wsi, (unsigned char *)"{\"jsonrpc\":\"2.0\",\"error\":{\"code\":-32000,\"message\":\"Response serialization failed\"},\"id\":null}",
-            strlen("{\"jsonrpc\":\"2.0\",\"error\":{\"code\":-32000,\"message\":\"Response serialization failed\"},\"id\":null}"),
-            LWS_WRITE_TEXT);
+      if (!conn->rx_paused) {
+         write_pending_events(conn);
       }
-      json_decref(request);
-      json_decref(response);
       break;
-   }
-   case LWS_CALLBACK_CLOSED: {
-      cleanup_subscriptions(wsi);
+   case LWS_CALLBACK_TIMER:
+      connection_timer(conn);
+      break;
+   case LWS_CALLBACK_RAW_CLOSE:
+      if (conn->pending) {
+         capture_frame(CAPTURE_CLOSE, conn->id, NULL, 0);
+         connection_close(conn);
+      }
       break;
-   }
    default:
       break;
    }
@@ -608,22 +3766,97 @@ static int callback_jsonrpc(struct lws *wsi, enum lws_callback_reasons reason,
    return 0;
 }
 
+// The raw listener has its own vhost, so only the raw protocol is offered there
+static struct lws_protocols raw_protocols[] = {
+    {
+        "raw-jsonrpc",
+        callback_raw,
+        sizeof(Connection),
+        4096,
+    },
+    { NULL, NULL, 0, 0 }
+};
+
 static struct lws_protocols protocols[] = {
     {
         "jsonrpc",
         callback_jsonrpc,
-        0,
+        sizeof(Connection),
         4096,
     },
+    {
+        "http-metrics",
+        callback_metrics,
+        sizeof(HttpResponse),
+        0,
+    },
+    {
+        "http-jsonrpc",
+        callback_http_jsonrpc,
+        sizeof(HttpRpc),
+        0,
+    },
+    {
+        "http-events",
+        callback_sse,
+        sizeof(Connection),
+        0,
+    },
     { NULL, NULL, 0, 0 }
 };
 
+// Serve /events, /jsonrpc and /metrics from the same listener as the WebSocket endpoint
+static const struct lws_http_mount events_mount = {
+    .mountpoint = "/events",
+    .origin = "http-events",
+    .origin_protocol = LWSMPRO_CALLBACK,
+    .mountpoint_len = 7,
+};
+
+static const struct lws_http_mount jsonrpc_mount = {
+    .mount_next = &events_mount,
+    .mountpoint = "/jsonrpc",
+    .origin = "http-jsonrpc",
+    .origin_protocol = LWSMPRO_CALLBACK,
+    .mountpoint_len = 8,
+};
+
+static const struct lws_http_mount metrics_mount = {
+    .mount_next = &jsonrpc_mount,
+    .mountpoint = "/metrics",
+    .origin = "http-metrics",
+    .origin_protocol = LWSMPRO_CALLBACK,
+    .mountpoint_len = 8,
+};
+
+// Get ready to create the Unix socket listener: remove a socket file left by a
+// previous run and set the umask so the socket is created with
+// unix_socket_mode. Returns the umask to restore. Names starting with '@' are
+// in the Linux abstract namespace and have no file.
+static mode_t unix_socket_prepare(void) {
+   struct stat st;
+   if (unix_socket[0] != '@' && lstat(unix_socket, &st) == 0 && S_ISSOCK(st.st_mode)) {
+      unlink(unix_socket);
+   }
+   return umask(~unix_socket_mode & 0777);
+}
+
 int main(int argc, char *argv[]) {
+   // jansson allocates through the request arena while one is enabled; this
+   // must precede any other jansson call
+   arena_install_json();
+
+   if (method_table_init() != 0) {
+      fprintf(stderr, "Error: cannot build the method dispatch table\n");
+      return 1;
+   }
+
    // Configure rbus logging
    rbus_setLogLevel(RBUS_LOG_ERROR);
 
    // Set up SIGTERM handler
    signal(SIGTERM, handle_sigterm);
+   signal(SIGUSR1, handle_sigusr1);
 
    // Initialize rbus
    if (rbus_open(&g_rbusHandle, "rbus-jsonrpc") != RBUS_ERROR_SUCCESS) {
@@ -695,36 +3928,164 @@ int main(int argc, char *argv[]) {
       }
    }
 
+   if (capture_file) {
+      capture_open();
+   }
+
+   // The service loop runs on this thread, so the request arena is bound here
+   if (request_arena_size > 0) {
+      if (arena_init(&request_arena, (size_t)request_arena_size) == 0) {
+         arena_bind(&request_arena);
+      } else {
+         fprintf(stderr, "Warning: Cannot allocate request arena, continuing without it\n");
+         request_arena_size = 0;
+      }
+   }
+
+   if (flight_recorder_init() != 0) {
+      fprintf(stderr, "Warning: Cannot allocate flight recorder, continuing without it\n");
+   }
+
    // Set protocols
    info.protocols = protocols;
+   info.mounts = &metrics_mount;
+
+   if (!tcp_enabled && !unix_socket) {
+      fprintf(stderr, "Warning: tcp_enabled is false but no unix_socket is set, listening on TCP\n");
+      tcp_enabled = true;
+   }
 
-   struct lws_context *context = lws_create_context(&info);
+   // The Unix socket gets its own vhost, or is the only one
+   struct lws_context_creation_info unix_info = info;
+   unix_info.options &= ~LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
+   unix_info.options |= LWS_SERVER_OPTION_UNIX_SOCK;
+   unix_info.iface = unix_socket;
+   unix_info.port = 0;
+   unix_info.vhost_name = "unix";
+
+   mode_t old_umask = 0;
+   if (!tcp_enabled) {
+      old_umask = unix_socket_prepare();
+   }
+   struct lws_context *context = lws_create_context(tcp_enabled ? &info : &unix_info);
+   if (!tcp_enabled) {
+      umask(old_umask);
+   }
+   g_context = context;
    if (!context) {
       fprintf(stderr, "lws init failed\n");
       if (info.vhost_name) free((char *)info.vhost_name);
       rbus_close(g_rbusHandle);
       return 1;
    }
+   if (pthread_create(&rbus_worker, NULL, run_rbus_worker, NULL) != 0) {
+      fprintf(stderr, "Cannot start the rbus worker thread\n");
+      lws_context_destroy(context);
+      if (info.vhost_name) free((char *)info.vhost_name);
+      rbus_close(g_rbusHandle);
+      return 1;
+   }
+
+   if (tcp_enabled && unix_socket) {
+      old_umask = unix_socket_prepare();
+      struct lws_vhost *unix_vhost = lws_create_vhost(context, &unix_info);
+      umask(old_umask);
+      if (!unix_vhost) {
+         fprintf(stderr, "Warning: Cannot listen on unix socket %s, continuing on TCP only\n", unix_socket);
+         free(unix_socket);
+         unix_socket = NULL;
+      }
+   }
 
-   printf("JSON-RPC WebSocket server running on ws://%s:%d\n", info.vhost_name, info.port);
+   // The raw listener is a separate vhost whose accepted sockets skip HTTP and
+   // are bound straight to the raw protocol
+   if (raw_tcp_port > 0) {
+      struct lws_context_creation_info raw_info = info;
+      raw_info.options = LWS_SERVER_OPTION_ADOPT_APPLY_LISTEN_ACCEPT_CONFIG;
+      raw_info.port = raw_tcp_port;
+      raw_info.vhost_name = "raw";
+      raw_info.protocols = raw_protocols;
+      raw_info.mounts = NULL;
+      raw_info.listen_accept_role = "raw-skt";
+      raw_info.listen_accept_protocol = "raw-jsonrpc";
+      if (!lws_create_vhost(context, &raw_info)) {
+         fprintf(stderr, "Warning: Cannot listen on raw TCP port %d, continuing without it\n", raw_tcp_port);
+         raw_tcp_port = 0;
+      }
+   }
+
+   if (tcp_enabled) {
+      printf("JSON-RPC WebSocket server running on ws://%s:%d\n", info.vhost_name, info.port);
+   }
+   if (raw_tcp_port > 0) {
+      printf("JSON-RPC raw TCP server running on %s:%d\n", info.vhost_name, raw_tcp_port);
+   }
+   if (unix_socket) {
+      printf("JSON-RPC WebSocket server running on unix socket %s\n", unix_socket);
+   }
 
    // Main event loop with shutdown check
    while (!shutdown_flag) {
       lws_service(context, 1000);
+      process_row_changes();
+      process_rbus_jobs();
+      expire_snapshots();
+      expire_sessions();
+      if (dump_flag) {
+         dump_flag = 0;
+         dump_flight_recorder();
+      }
+      if (capture_out) {
+         fflush(capture_out);
+      }
    }
 
    printf("Received SIGTERM, shutting down...\n");
 
    // Cleanup
-   for (int i = 0; i < subscription_count; i++) {
-      rbusEvent_Unsubscribe(g_rbusHandle, subscriptions[i].eventName);
-      free(subscriptions[i].eventName);
+   stop_rbus_worker();
+   for (Session *session = sessions; session; session = session->next) {
+      cleanup_subscriptions(session);
    }
-   subscription_count = 0;
+   pthread_mutex_lock(&event_lock);
+   free(subscriptions);
+   free(name_buckets);
+   subscriptions = NULL;
+   name_buckets = NULL;
+   subscription_capacity = 0;
+   pthread_mutex_unlock(&event_lock);
+   process_row_changes();
 
    lws_context_destroy(context);
+   if (unix_socket) {
+      if (unix_socket[0] != '@') {
+         unlink(unix_socket);
+      }
+      free(unix_socket);
+   }
+   while (sessions) {
+      Session *session = sessions;
+      sessions = session->next;
+      destroy_session(session);
+   }
    if (info.vhost_name) free((char *)info.vhost_name);
    rbus_close(g_rbusHandle);
+   for (size_t m = 0; m < METRIC_METHOD_COUNT; m++) {
+      for (int p = 0; p <= MAX_STATS_PREFIXES; p++) {
+         free(atomic_load(&stats_cells[m][p]));
+      }
+   }
+   for (int i = 0; i < stats_prefix_count; i++) {
+      free(stats_prefixes[i]);
+   }
+   arena_bind(NULL);
+   arena_destroy(&request_arena);
+   free(flight_records);
+   free(flight_recorder_file);
+   if (capture_out) {
+      fclose(capture_out);
+   }
+   free(capture_file);
 
    printf("Server shutdown complete\n");
    return 0;
@@ -0,0 +1,462 @@
+// Load generator for rbus_jsonrpc: opens N WebSocket connections, keeps up to
+// a pipelining depth of requests in flight on each, and reports throughput and
+// latency percentiles per operation.
+#include <libwebsockets.h>
+#include <jansson.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rbus_histogram.h"
+
+#define MAX_DEPTH 1024
+
+static volatile sig_atomic_t interrupted = 0;
+
+// Operations the traffic mix is made of
+typedef enum {
+   OP_GET,
+   OP_SET,
+   OP_SUBSCRIBE,
+   OP_COUNT
+} BenchOp;
+
+static const char *const op_names[OP_COUNT] = { "get", "set", "subscribe" };
+
+// Command-line settings
+static const char *host = "localhost";
+static int port = 8080;
+static int connection_count = 8;
+static int depth = 1;
+static int duration_secs = 10;
+static int mix[OP_COUNT] = { 100, 0, 0 };
+static const char *get_path = "Device.DeviceInfo.ModelName";
+static const char *set_path = "Device.Test.Property";
+static const char *set_value = "bench";
+static const char *event_name = "Device.Test.Property";
+
+// Results, only touched from the lws service thread
+static Histogram latency[OP_COUNT];
+static uint64_t errors[OP_COUNT];
+static uint64_t unmatched = 0; // Responses without a usable id, e.g. parse errors
+static uint64_t events_received = 0;
+static uint64_t bytes_received = 0;
+static int connected = 0;
+static int failed = 0;
+static int total_in_flight = 0;
+static bool sending = true;
+// Responses to requests sent before this time are not counted: connections
+// start sending as soon as they open, before the measured window
+static int64_t measure_start_ns = INT64_MAX;
+
+// Per-connection state (lws user data). Each request in flight has a slot
+// keyed by its full id; responses can arrive out of order, so a slot is only
+// reused once its own response is in.
+typedef struct {
+   struct lws *wsi;
+   unsigned int seed;
+   json_int_t next_id;
+   int in_flight;
+   bool subscribed;          // Next subscribe op unsubscribes
+   json_int_t sent_id[MAX_DEPTH]; // -1 for a free slot
+   int64_t sent_ns[MAX_DEPTH];
+   BenchOp sent_op[MAX_DEPTH];
+   char *rx;                 // Reassembly buffer for fragmented messages
+   size_t rx_len;
+} BenchConnection;
+
+static int64_t monotonic_ns(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Find the slot of the request with id, or with id -1 a free slot; -1 if none
+static int find_slot(const BenchConnection *conn, json_int_t id) {
+   for (int slot = 0; slot < depth; slot++) {
+      if (conn->sent_id[slot] == id) {
+         return slot;
+      }
+   }
+   return -1;
+}
+
+// Slot of the request longest in flight, or -1 if none
+static int oldest_slot(const BenchConnection *conn) {
+   int oldest = -1;
+   for (int slot = 0; slot < depth; slot++) {
+      if (conn->sent_id[slot] >= 0 && (oldest < 0 || conn->sent_ns[slot] < conn->sent_ns[oldest])) {
+         oldest = slot;
+      }
+   }
+   return oldest;
+}
+
+// Count a response to the request in slot, if it was sent in the measured
+// window, and free the slot
+static void finish_request(BenchConnection *conn, int slot, int64_t now_ns, bool error) {
+   BenchOp op = conn->sent_op[slot];
+   if (conn->sent_ns[slot] >= measure_start_ns) {
+      histogram_record(&latency[op], (uint64_t)(now_ns - conn->sent_ns[slot]));
+      if (error) {
+         errors[op]++;
+      }
+   }
+   conn->sent_id[slot] = -1;
+   conn->in_flight--;
+   total_in_flight--;
+}
+
+static void handle_sigint(int sig) {
+   (void)sig;
+   interrupted = 1;
+}
+
+// Pick the next operation according to the traffic mix
+static BenchOp pick_op(BenchConnection *conn) {
+   int total = mix[OP_GET] + mix[OP_SET] + mix[OP_SUBSCRIBE];
+   int roll = rand_r(&conn->seed) % total;
+   for (int op = 0; op < OP_COUNT; op++) {
+      if (roll < mix[op]) {
+         return (BenchOp)op;
+      }
+      roll -= mix[op];
+   }
+   return OP_GET;
+}
+
+// Build and send one request. Subscribe ops alternate between subscribing and
+// unsubscribing so the server's subscription table stays bounded.
+static int send_request(BenchConnection *conn) {
+   BenchOp op = pick_op(conn);
+   json_int_t id = conn->next_id++;
+
+   json_t *params = json_object();
+   const char *method;
+   switch (op) {
+   case OP_SET:
+      method = "rbus_set";
+      json_object_set_new(params, "path", json_string(set_path));
+      json_object_set_new(params, "value", json_string(set_value));
+      break;
+   case OP_SUBSCRIBE:
+      method = conn->subscribed ? "rbusEvent_Unsubscribe" : "rbusEvent_Subscribe";
+      json_object_set_new(params, "eventName", json_string(event_name));
+      conn->subscribed = !conn->subscribed;
+      break;
+   default:
+      method = "rbus_get";
+      json_object_set_new(params, "path", json_string(get_path));
+      break;
+   }
+
+   json_t *request = json_object();
+   json_object_set_new(request, "jsonrpc", json_string("2.0"));
+   json_object_set_new(request, "method", json_string(method));
+   json_object_set_new(request, "params", params);
+   json_object_set_new(request, "id", json_integer(id));
+   char *text = json_dumps(request, JSON_COMPACT);
+   json_decref(request);
+   if (!text) {
+      return -1;
+   }
+
+   size_t len = strlen(text);
+   unsigned char *buffer = malloc(LWS_PRE + len);
+   if (!buffer) {
+      free(text);
+      return -1;
+   }
+   memcpy(buffer + LWS_PRE, text, len);
+   free(text);
+
+   int slot = find_slot(conn, -1);
+   if (slot < 0) {
+      free(buffer);
+      return -1;
+   }
+   conn->sent_id[slot] = id;
+   conn->sent_ns[slot] = monotonic_ns();
+   conn->sent_op[slot] = op;
+   conn->in_flight++;
+   total_in_flight++;
+   int written = lws_write(conn->wsi, buffer + LWS_PRE, len, LWS_WRITE_TEXT);
+   free(buffer);
+   return written < (int)len ? -1 : 0;
+}
+
+// Match a complete message to its request, or count it as an event notification
+static void handle_message(BenchConnection *conn, const char *text, size_t len) {
+   int64_t now_ns = monotonic_ns();
+   bytes_received += len;
+
+   json_error_t error;
+   json_t *message = json_loadb(text, len, 0, &error);
+   if (!message) {
+      fprintf(stderr, "Unparseable message: %s\n", error.text);
+      return;
+   }
+
+   json_t *id = json_object_get(message, "id");
+   int slot = json_is_integer(id) ? find_slot(conn, json_integer_value(id)) : -1;
+   if (slot >= 0) {
+      finish_request(conn, slot, now_ns, json_object_get(message, "error") != NULL);
+   } else if (json_object_get(message, "method")) {
+      json_t *params = json_object_get(message, "params");
+      json_t *batch = json_object_get(params, "events");
+      events_received += json_is_array(batch) ? json_array_size(batch) : 1;
+   } else if (conn->in_flight > 0) {
+      // A response we cannot match to its request (the server answers parse
+      // errors with a null id). It still ends one request, taken to be the
+      // oldest, so free its slot rather than stall the connection at depth.
+      unmatched++;
+      conn->sent_id[oldest_slot(conn)] = -1;
+      conn->in_flight--;
+      total_in_flight--;
+   }
+   json_decref(message);
+}
+
+static int callback_bench(struct lws *wsi, enum lws_callback_reasons reason,
+   void *user, void *in, size_t len) {
+   BenchConnection *conn = (BenchConnection *)user;
+
+   switch (reason) {
+   case LWS_CALLBACK_CLIENT_ESTABLISHED:
+      conn->wsi = wsi;
+      conn->seed = (unsigned int)(uintptr_t)wsi ^ (unsigned int)monotonic_ns();
+      for (int slot = 0; slot < depth; slot++) {
+         conn->sent_id[slot] = -1;
+      }
+      connected++;
+      lws_callback_on_writable(wsi);
+      break;
+   case LWS_CALLBACK_CLIENT_WRITEABLE:
+      if (sending && conn->in_flight < depth) {
+         if (send_request(conn) != 0) {
+            return -1;
+         }
+         if (conn->in_flight < depth) {
+            lws_callback_on_writable(wsi);
+         }
+      }
+      break;
+   case LWS_CALLBACK_CLIENT_RECEIVE: {
+      bool first = lws_is_first_fragment(wsi);
+      bool final = lws_is_final_fragment(wsi);
+      if (first && final) {
+         handle_message(conn, in, len);
+      } else {
+         char *grown = realloc(first ? NULL : conn->rx, (first ? 0 : conn->rx_len) + len);
+         if (!grown) {
+            return -1;
+         }
+         if (first) {
+            free(conn->rx);
+            conn->rx_len = 0;
+         }
+         conn->rx = grown;
+         memcpy(conn->rx + conn->rx_len, in, len);
+         conn->rx_len += len;
+         if (final) {
+            handle_message(conn, conn->rx, conn->rx_len);
+            conn->rx_len = 0;
+         }
+      }
+      if (sending && conn->in_flight < depth) {
+         lws_callback_on_writable(wsi);
+      }
+      break;
+   }
+   case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+      fprintf(stderr, "Connection failed: %s\n", in ? (const char *)in : "unknown error");
+      failed++;
+      break;
+   case LWS_CALLBACK_CLIENT_CLOSED:
+      total_in_flight -= conn->in_flight;
+      conn->in_flight = 0;
+      free(conn->rx);
+      conn->rx = NULL;
+      connected--;
+      break;
+   default:
+      break;
+   }
+   return 0;
+}
+
+static const struct lws_protocols protocols[] = {
+   { "jsonrpc", callback_bench, sizeof(BenchConnection), 65536, 0, NULL, 0 },
+   LWS_PROTOCOL_LIST_TERM
+};
+
+// Parse a traffic mix such as "get:70,set:20,subscribe:10"
+static int parse_mix(const char *spec) {
+   int parsed[OP_COUNT] = { 0 };
+   char *copy = strdup(spec);
+   if (!copy) {
+      return -1;
+   }
+   char *saveptr = NULL;
+   for (char *item = strtok_r(copy, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+      char *colon = strchr(item, ':');
+      if (!colon) {
+         free(copy);
+         return -1;
+      }
+      *colon = '\0';
+      int op = 0;
+      while (op < OP_COUNT && strcmp(op_names[op], item) != 0) {
+         op++;
+      }
+      int weight = atoi(colon + 1);
+      if (op == OP_COUNT || weight < 0) {
+         free(copy);
+         return -1;
+      }
+      parsed[op] = weight;
+   }
+   free(copy);
+   if (parsed[OP_GET] + parsed[OP_SET] + parsed[OP_SUBSCRIBE] <= 0) {
+      return -1;
+   }
+   memcpy(mix, parsed, sizeof(mix));
+   return 0;
+}
+
+static void usage(const char *name) {
+   fprintf(stderr,
+      "Usage: %s [-H host] [-p port] [-c connections] [-d depth] [-t seconds]\n"
+      "          [-m get:N,set:N,subscribe:N] [-g get_path] [-s set_path] [-v set_value] [-e event_name]\n",
+      name);
+}
+
+// elapsed is the measured send window, so req/s is the rate requests sent in it
+// were completed at
+static void print_row(const char *name, Histogram *h, uint64_t errs, double elapsed) {
+   uint64_t total = atomic_load(&h->total);
+   printf("%-10s %10llu %8llu %12.1f %9.3f %9.3f %9.3f %9.3f\n", name,
+      (unsigned long long)total, (unsigned long long)errs, (double)total / elapsed,
+      (double)histogram_percentile(h, 0.5) / 1e6, (double)histogram_percentile(h, 0.99) / 1e6,
+      (double)histogram_percentile(h, 0.999) / 1e6, (double)atomic_load(&h->max_ns) / 1e6);
+}
+
+int main(int argc, char *argv[]) {
+   int opt;
+   while ((opt = getopt(argc, argv, "H:p:c:d:t:m:g:s:v:e:h")) != -1) {
+      switch (opt) {
+      case 'H': host = optarg; break;
+      case 'p': port = atoi(optarg); break;
+      case 'c': connection_count = atoi(optarg); break;
+      case 'd': depth = atoi(optarg); break;
+      case 't': duration_secs = atoi(optarg); break;
+      case 'm':
+         if (parse_mix(optarg) != 0) {
+            fprintf(stderr, "Error: Invalid mix %s\n", optarg);
+            return 1;
+         }
+         break;
+      case 'g': get_path = optarg; break;
+      case 's': set_path = optarg; break;
+      case 'v': set_value = optarg; break;
+      case 'e': event_name = optarg; break;
+      default:
+         usage(argv[0]);
+         return 1;
+      }
+   }
+   if (port <= 0 || port > 65535 || connection_count <= 0 || depth <= 0 || depth > MAX_DEPTH ||
+      duration_secs <= 0) {
+      usage(argv[0]);
+      return 1;
+   }
+
+   signal(SIGINT, handle_sigint);
+   lws_set_log_level(LLL_ERR, NULL);
+
+   struct lws_context_creation_info info = {0};
+   info.port = CONTEXT_PORT_NO_LISTEN;
+   info.protocols = protocols;
+   struct lws_context *context = lws_create_context(&info);
+   if (!context) {
+      fprintf(stderr, "lws init failed\n");
+      return 1;
+   }
+
+   for (int i = 0; i < connection_count; i++) {
+      struct lws_client_connect_info connect = {0};
+      connect.context = context;
+      connect.address = host;
+      connect.port = port;
+      connect.path = "/";
+      connect.host = host;
+      connect.origin = host;
+      connect.protocol = protocols[0].name;
+      if (!lws_client_connect_via_info(&connect)) {
+         fprintf(stderr, "Connection %d failed to start\n", i);
+         failed++;
+      }
+   }
+
+   // Wait for every connection to either open or fail before timing starts
+   while (!interrupted && connected + failed < connection_count) {
+      lws_service(context, 100);
+   }
+   if (connected == 0) {
+      fprintf(stderr, "Error: No connections to %s:%d\n", host, port);
+      lws_context_destroy(context);
+      return 1;
+   }
+   memset(latency, 0, sizeof(latency));
+   memset(errors, 0, sizeof(errors));
+   unmatched = 0;
+   events_received = 0;
+   bytes_received = 0;
+
+   int64_t start_ns = monotonic_ns();
+   measure_start_ns = start_ns;
+   int64_t stop_ns = start_ns + (int64_t)duration_secs * 1000000000;
+   while (!interrupted && monotonic_ns() < stop_ns) {
+      lws_service(context, 50);
+   }
+   sending = false;
+   int64_t sent_ns = monotonic_ns();
+   double elapsed = (double)(sent_ns - start_ns) / 1e9;
+
+   // Give in-flight requests a moment to complete so they are counted. The
+   // drain is reported on its own and not part of the window throughput is
+   // computed over.
+   int64_t drain_ns = sent_ns + 2000000000;
+   while (!interrupted && total_in_flight > 0 && monotonic_ns() < drain_ns) {
+      lws_service(context, 50);
+   }
+   double drain = (double)(monotonic_ns() - sent_ns) / 1e9;
+
+   Histogram all = {0};
+   uint64_t all_errors = 0;
+   printf("%d connections, depth %d, %.1f s sending, %.3f s draining\n", connected, depth, elapsed, drain);
+   printf("%-10s %10s %8s %12s %9s %9s %9s %9s\n", "op", "requests", "errors", "req/s",
+      "p50 ms", "p99 ms", "p999 ms", "max ms");
+   for (int op = 0; op < OP_COUNT; op++) {
+      if (atomic_load(&latency[op].total) > 0) {
+         print_row(op_names[op], &latency[op], errors[op], elapsed);
+      }
+      histogram_merge(&all, &latency[op]);
+      all_errors += errors[op];
+   }
+   print_row("total", &all, all_errors, elapsed);
+   printf("events received: %llu, bytes received: %llu\n", (unsigned long long)events_received,
+      (unsigned long long)bytes_received);
+   if (unmatched > 0 || total_in_flight > 0) {
+      printf("unmatched responses: %llu, unanswered requests: %d\n", (unsigned long long)unmatched,
+         total_in_flight);
+   }
+
+   lws_context_destroy(context);
+   return 0;
+}
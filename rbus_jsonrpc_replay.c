@@ -0,0 +1,517 @@
+// Replays a traffic capture written by rbus_jsonrpc (capture_file config)
+// against a gateway: every captured connection is reopened and its frames are
+// resent on the original schedule, optionally sped up. Reports response
+// latency and responses whose error status differs from the capture. Which
+// frames are answered is taken from the captured responses, not assumed.
+#include <libwebsockets.h>
+#include <jansson.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rbus_histogram.h"
+#include "rbus_capture.h"
+
+// How long to wait for outstanding responses after the last captured frame
+#define DRAIN_TIMEOUT_NS 5000000000LL
+
+static volatile sig_atomic_t interrupted = 0;
+
+// A captured record, with its payload
+typedef struct {
+   uint64_t time_ns;
+   uint32_t conn_id;
+   uint8_t type;
+   int response;    // Inbound frames: index of the captured response to it, -1 for none
+   json_t *id;      // Response frames: the id answered, the first element's for a batch
+   int64_t sent_ns; // Inbound frames: when the replay sent it
+   char *payload;
+   size_t length;
+} Frame;
+
+// A replayed connection (lws user data for its wsi)
+typedef struct {
+   uint32_t conn_id;
+   struct lws *wsi;
+   bool captured_open;    // The capture saw it open
+   bool open;
+   bool closing;         // Capture closed it; close once drained
+   bool done;
+   int *outgoing;         // Inbound frame indices waiting to be sent
+   int outgoing_head;
+   int outgoing_count;
+   int *awaiting;         // Sent inbound frame indices whose response is due, oldest first
+   int awaiting_count;
+   char *rx;
+   size_t rx_len;
+} ReplayConnection;
+
+static Frame *frames = NULL;
+static int frame_count = 0;
+static ReplayConnection *replays = NULL;
+static int replay_count = 0;
+
+static Histogram latency;
+static uint64_t frames_sent = 0;
+static uint64_t responses = 0;
+static uint64_t notifications = 0;
+static uint64_t mismatches = 0;
+static uint64_t unexpected = 0;
+static int active = 0;
+
+static int64_t monotonic_ns(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void handle_sigint(int sig) {
+   (void)sig;
+   interrupted = 1;
+}
+
+// Id a response answers: its own, or for a batch its first element's
+static json_t *response_id(json_t *response) {
+   if (json_is_array(response)) {
+      response = json_array_get(response, 0);
+   }
+   json_t *id = json_object_get(response, "id");
+   return id ? id : json_null();
+}
+
+// Whether an inbound frame is a request, or a batch holding one, with this id
+static bool frame_has_id(const Frame *frame, json_t *id) {
+   json_error_t error;
+   json_t *message = json_loadb(frame->payload, frame->length, 0, &error);
+   bool found = false;
+   if (json_is_array(message)) {
+      size_t index;
+      json_t *item;
+      json_array_foreach(message, index, item) {
+         json_t *item_id = json_object_get(item, "id");
+         found = found || (item_id && json_equal(item_id, id));
+      }
+   } else {
+      json_t *message_id = json_object_get(message, "id");
+      found = message_id && json_equal(message_id, id);
+   }
+   json_decref(message);
+   return found;
+}
+
+// Attribute a captured response to the inbound frame it answers: the latest
+// unanswered frame on its connection with the response's id, else the latest
+// unanswered one. The gateway answers most frames straight away, but deferred
+// responses (snapshot subscribes) come later and are found by id.
+static void attribute_response(int response) {
+   Frame *captured = &frames[response];
+   int fallback = -1;
+   for (int i = response - 1; i >= 0; i--) {
+      Frame *frame = &frames[i];
+      if (frame->conn_id != captured->conn_id) {
+         continue;
+      }
+      if (frame->type == CAPTURE_OPEN) {
+         break;
+      }
+      if (frame->type != CAPTURE_INBOUND || frame->response >= 0) {
+         continue;
+      }
+      if (frame_has_id(frame, captured->id)) {
+         frame->response = response;
+         return;
+      }
+      if (fallback < 0) {
+         fallback = i;
+      }
+   }
+   if (fallback >= 0) {
+      frames[fallback].response = response;
+   }
+}
+
+// Frames still to send or answers still due on open connections
+static int outstanding(void) {
+   int count = 0;
+   for (int i = 0; i < replay_count; i++) {
+      if (!replays[i].done) {
+         count += replays[i].outgoing_count + replays[i].awaiting_count;
+      }
+   }
+   return count;
+}
+
+static ReplayConnection *find_replay(uint32_t conn_id) {
+   for (int i = 0; i < replay_count; i++) {
+      if (replays[i].conn_id == conn_id) {
+         return &replays[i];
+      }
+   }
+   return NULL;
+}
+
+// Read the capture, then size each connection's queues from its frame counts
+static int load_capture(const char *path) {
+   FILE *in = fopen(path, "rb");
+   if (!in) {
+      perror(path);
+      return -1;
+   }
+   CaptureHeader header;
+   if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != CAPTURE_VERSION) {
+      fprintf(stderr, "Error: %s is not a version %d capture file\n", path, CAPTURE_VERSION);
+      fclose(in);
+      return -1;
+   }
+
+   int capacity = 0;
+   CaptureRecord record;
+   while (fread(&record, sizeof(record), 1, in) == 1) {
+      if (frame_count == capacity) {
+         capacity = capacity ? capacity * 2 : 1024;
+         Frame *grown = realloc(frames, capacity * sizeof(Frame));
+         if (!grown) {
+            fclose(in);
+            return -1;
+         }
+         frames = grown;
+      }
+      Frame *frame = &frames[frame_count];
+      memset(frame, 0, sizeof(*frame));
+      frame->time_ns = record.time_ns;
+      frame->conn_id = record.conn_id;
+      frame->type = record.type;
+      frame->response = -1;
+      frame->length = record.length;
+      if (record.length > 0) {
+         frame->payload = malloc(record.length);
+         if (!frame->payload || fread(frame->payload, 1, record.length, in) != record.length) {
+            fprintf(stderr, "Warning: %s is truncated, replaying %d records\n", path, frame_count);
+            free(frame->payload);
+            break;
+         }
+      }
+      if (frame->type == CAPTURE_RESPONSE) {
+         json_error_t error;
+         json_t *response = json_loadb(frame->payload, frame->length, 0, &error);
+         frame->id = json_incref(response_id(response));
+         json_decref(response);
+         frame_count++;
+         attribute_response(frame_count - 1);
+         continue;
+      }
+      frame_count++;
+   }
+   fclose(in);
+
+   // One ReplayConnection per captured connection; frames of connections
+   // already open when the capture started get one too
+   replays = calloc(frame_count ? frame_count : 1, sizeof(ReplayConnection));
+   if (!replays) {
+      return -1;
+   }
+   for (int i = 0; i < frame_count; i++) {
+      ReplayConnection *rc = find_replay(frames[i].conn_id);
+      if (!rc) {
+         rc = &replays[replay_count++];
+         rc->conn_id = frames[i].conn_id;
+      }
+      if (frames[i].type == CAPTURE_OPEN) {
+         rc->captured_open = true;
+      } else if (frames[i].type == CAPTURE_INBOUND) {
+         rc->outgoing_count++;
+      }
+   }
+   for (int i = 0; i < replay_count; i++) {
+      ReplayConnection *rc = &replays[i];
+      rc->outgoing = calloc(rc->outgoing_count + 1, sizeof(int));
+      rc->awaiting = calloc(rc->outgoing_count + 1, sizeof(int));
+      if (!rc->outgoing || !rc->awaiting) {
+         return -1;
+      }
+      rc->outgoing_count = 0;
+   }
+   return 0;
+}
+
+// Error code of a response, 0 for success
+static json_int_t response_status(json_t *response) {
+   if (json_is_array(response)) {
+      response = json_array_get(response, 0);
+   }
+   return json_integer_value(json_object_get(json_object_get(response, "error"), "code"));
+}
+
+// Time a response against the frame it answers, matched by id, and compare its
+// status with the captured one
+static void handle_message(ReplayConnection *rc, const char *text, size_t len) {
+   int64_t now_ns = monotonic_ns();
+   json_error_t error;
+   json_t *message = json_loadb(text, len, 0, &error);
+   if (!message) {
+      return;
+   }
+   if (json_is_object(message) && !json_object_get(message, "id") && json_object_get(message, "method")) {
+      notifications++;
+      json_decref(message);
+      return;
+   }
+
+   responses++;
+   json_t *id = response_id(message);
+   int i = 0;
+   while (i < rc->awaiting_count && !json_equal(frames[frames[rc->awaiting[i]].response].id, id)) {
+      i++;
+   }
+   if (i == rc->awaiting_count) {
+      // Not answered in the capture, or answered twice now
+      unexpected++;
+      json_decref(message);
+      return;
+   }
+   Frame *frame = &frames[rc->awaiting[i]];
+   memmove(&rc->awaiting[i], &rc->awaiting[i + 1], (rc->awaiting_count - i - 1) * sizeof(int));
+   rc->awaiting_count--;
+   histogram_record(&latency, (uint64_t)(now_ns - frame->sent_ns));
+
+   Frame *captured = &frames[frame->response];
+   json_t *original = json_loadb(captured->payload, captured->length, 0, &error);
+   if (original && response_status(original) != response_status(message)) {
+      mismatches++;
+   }
+   json_decref(original);
+   json_decref(message);
+}
+
+static int callback_replay(struct lws *wsi, enum lws_callback_reasons reason,
+   void *user, void *in, size_t len) {
+   ReplayConnection *rc = (ReplayConnection *)user;
+
+   switch (reason) {
+   case LWS_CALLBACK_CLIENT_ESTABLISHED:
+      rc->open = true;
+      lws_callback_on_writable(wsi);
+      break;
+   case LWS_CALLBACK_CLIENT_WRITEABLE: {
+      if (rc->outgoing_count == 0) {
+         // Close once the capture closed this connection and its responses are in
+         return rc->closing && rc->awaiting_count == 0 ? -1 : 0;
+      }
+      int index = rc->outgoing[rc->outgoing_head++];
+      Frame *frame = &frames[index];
+      rc->outgoing_count--;
+      unsigned char *buffer = malloc(LWS_PRE + frame->length);
+      if (!buffer) {
+         return -1;
+      }
+      memcpy(buffer + LWS_PRE, frame->payload, frame->length);
+      if (frame->response >= 0) {
+         frame->sent_ns = monotonic_ns();
+         rc->awaiting[rc->awaiting_count++] = index;
+      }
+      int written = lws_write(wsi, buffer + LWS_PRE, frame->length, LWS_WRITE_TEXT);
+      free(buffer);
+      if (written < (int)frame->length) {
+         return -1;
+      }
+      frames_sent++;
+      if (rc->outgoing_count > 0 || rc->closing) {
+         lws_callback_on_writable(wsi);
+      }
+      break;
+   }
+   case LWS_CALLBACK_CLIENT_RECEIVE: {
+      bool first = lws_is_first_fragment(wsi);
+      bool final = lws_is_final_fragment(wsi);
+      if (first && final) {
+         handle_message(rc, in, len);
+      } else {
+         size_t offset = first ? 0 : rc->rx_len;
+         char *grown = realloc(rc->rx, offset + len);
+         if (!grown) {
+            return -1;
+         }
+         rc->rx = grown;
+         memcpy(rc->rx + offset, in, len);
+         rc->rx_len = offset + len;
+         if (final) {
+            handle_message(rc, rc->rx, rc->rx_len);
+         }
+      }
+      if (rc->closing && rc->awaiting_count == 0 && rc->outgoing_count == 0) {
+         lws_callback_on_writable(wsi);
+      }
+      break;
+   }
+   case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+      fprintf(stderr, "Connection %u failed: %s\n", rc->conn_id, in ? (const char *)in : "unknown error");
+      // fallthrough
+   case LWS_CALLBACK_CLIENT_CLOSED:
+      if (!rc->done) {
+         rc->done = true;
+         rc->open = false;
+         active--;
+      }
+      free(rc->rx);
+      rc->rx = NULL;
+      break;
+   default:
+      break;
+   }
+   return 0;
+}
+
+static const struct lws_protocols protocols[] = {
+   { "jsonrpc", callback_replay, 0, 65536, 0, NULL, 0 },
+   LWS_PROTOCOL_LIST_TERM
+};
+
+static void connect_replay(struct lws_context *context, ReplayConnection *rc, const char *host, int port) {
+   struct lws_client_connect_info connect = {0};
+   connect.context = context;
+   connect.address = host;
+   connect.port = port;
+   connect.path = "/";
+   connect.host = host;
+   connect.origin = host;
+   connect.protocol = protocols[0].name;
+   connect.userdata = rc;
+   connect.pwsi = &rc->wsi;
+   active++;
+   if (!lws_client_connect_via_info(&connect)) {
+      fprintf(stderr, "Connection %u failed to start\n", rc->conn_id);
+      rc->done = true;
+      active--;
+   }
+}
+
+static void usage(const char *name) {
+   fprintf(stderr, "Usage: %s [-H host] [-p port] [-s speed] capture_file\n"
+      "  -s: Playback speed, e.g. 1 (as captured, default), 10 (ten times faster), 0 (as fast as possible)\n",
+      name);
+}
+
+int main(int argc, char *argv[]) {
+   const char *host = "localhost";
+   int port = 8080;
+   double speed = 1.0;
+   int opt;
+   while ((opt = getopt(argc, argv, "H:p:s:h")) != -1) {
+      switch (opt) {
+      case 'H': host = optarg; break;
+      case 'p': port = atoi(optarg); break;
+      case 's': speed = atof(optarg); break;
+      default:
+         usage(argv[0]);
+         return 1;
+      }
+   }
+   if (optind != argc - 1 || port <= 0 || port > 65535 || speed < 0) {
+      usage(argv[0]);
+      return 1;
+   }
+   if (load_capture(argv[optind]) != 0) {
+      return 1;
+   }
+
+   signal(SIGINT, handle_sigint);
+   lws_set_log_level(LLL_ERR, NULL);
+
+   struct lws_context_creation_info info = {0};
+   info.port = CONTEXT_PORT_NO_LISTEN;
+   info.protocols = protocols;
+   struct lws_context *context = lws_create_context(&info);
+   if (!context) {
+      fprintf(stderr, "lws init failed\n");
+      return 1;
+   }
+
+   // Connections that were already open when the capture started have no
+   // open record, so open them up front
+   for (int i = 0; i < replay_count; i++) {
+      if (!replays[i].captured_open) {
+         connect_replay(context, &replays[i], host, port);
+      }
+   }
+
+   int64_t start_ns = monotonic_ns();
+   int64_t drain_ns = 0;
+   int next = 0;
+   while (!interrupted && (next < frame_count || active > 0)) {
+      int64_t now_ns = monotonic_ns();
+      // Connections the capture left open are not waited for, and answers that
+      // never come only for a while
+      if (next == frame_count) {
+         drain_ns = drain_ns ? drain_ns : now_ns;
+         if (outstanding() == 0 || now_ns - drain_ns > DRAIN_TIMEOUT_NS) {
+            break;
+         }
+      }
+      while (next < frame_count &&
+         (speed == 0 || (double)(now_ns - start_ns) * speed >= (double)frames[next].time_ns)) {
+         Frame *frame = &frames[next];
+         ReplayConnection *rc = find_replay(frame->conn_id);
+         switch (frame->type) {
+         case CAPTURE_OPEN:
+            if (!rc->wsi && !rc->done) {
+               connect_replay(context, rc, host, port);
+            }
+            break;
+         case CAPTURE_INBOUND:
+            rc->outgoing[rc->outgoing_head + rc->outgoing_count++] = next;
+            if (rc->open) {
+               lws_callback_on_writable(rc->wsi);
+            }
+            break;
+         case CAPTURE_CLOSE:
+            rc->closing = true;
+            if (rc->open) {
+               lws_callback_on_writable(rc->wsi);
+            }
+            break;
+         default:
+            break;
+         }
+         next++;
+      }
+      lws_service(context, next < frame_count ? 1 : 50);
+   }
+   double elapsed = (double)(monotonic_ns() - start_ns) / 1e9;
+   int unanswered = 0;
+   for (int i = 0; i < replay_count; i++) {
+      unanswered += replays[i].awaiting_count;
+   }
+   double captured = frame_count ? (double)frames[frame_count - 1].time_ns / 1e9 : 0;
+
+   printf("replayed %d connections, %llu frames in %.2f s (captured over %.2f s)\n", replay_count,
+      (unsigned long long)frames_sent, elapsed, captured);
+   printf("responses: %llu, notifications: %llu, status mismatches: %llu\n", (unsigned long long)responses,
+      (unsigned long long)notifications, (unsigned long long)mismatches);
+   if (unexpected > 0 || unanswered > 0) {
+      printf("responses not in the capture: %llu, captured responses not received: %d\n",
+         (unsigned long long)unexpected, unanswered);
+   }
+   printf("latency ms: p50 %.3f  p99 %.3f  p999 %.3f  max %.3f\n", (double)histogram_percentile(&latency, 0.5) / 1e6,
+      (double)histogram_percentile(&latency, 0.99) / 1e6, (double)histogram_percentile(&latency, 0.999) / 1e6,
+      (double)atomic_load(&latency.max_ns) / 1e6);
+
+   lws_context_destroy(context);
+   for (int i = 0; i < replay_count; i++) {
+      free(replays[i].outgoing);
+      free(replays[i].awaiting);
+      free(replays[i].rx);
+   }
+   free(replays);
+   for (int i = 0; i < frame_count; i++) {
+      free(frames[i].payload);
+      json_decref(frames[i].id);
+   }
+   free(frames);
+   return 0;
+}
@@ -0,0 +1,406 @@
+// Synthetic rbus provider for load-testing the gateway without real providers.
+// Registers a data model of writable parameters, tables and event sources under
+// Device.Mock., with optional injected handler latency.
+#include <rbus.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PARAM_PREFIX "Device.Mock.Param."
+#define TABLE_PREFIX "Device.Mock.Table"
+#define EVENT_PREFIX "Device.Mock.Event"
+
+static volatile sig_atomic_t shutdown_flag = 0;
+
+// Command-line settings
+static int param_count = 100;
+static int table_count = 2;
+static int row_count = 10;
+static int event_count = 1;
+static int event_rate = 10;      // Publishes per second per event
+static int latency_us = 0;       // Added to every get and set handler
+static int jitter_us = 0;        // Random extra latency, 0..jitter_us
+
+// Parameter values, guarded by model_lock
+static rbusValue_t *param_values = NULL;
+static pthread_mutex_t model_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Subscriber counts per event source, so idle events are not published
+static int *event_subscribers = NULL;
+
+static void handle_signal(int sig) {
+   (void)sig;
+   shutdown_flag = 1;
+}
+
+static void inject_latency(void) {
+   int delay_us = latency_us;
+   if (jitter_us > 0) {
+      delay_us += rand() % (jitter_us + 1);
+   }
+   if (delay_us > 0) {
+      struct timespec ts = { delay_us / 1000000, (long)(delay_us % 1000000) * 1000 };
+      nanosleep(&ts, NULL);
+   }
+}
+
+// Index of Device.Mock.Param.N, or -1
+static int param_index(const char *name) {
+   if (strncmp(name, PARAM_PREFIX, strlen(PARAM_PREFIX)) != 0) {
+      return -1;
+   }
+   int index = atoi(name + strlen(PARAM_PREFIX)) - 1;
+   return index >= 0 && index < param_count ? index : -1;
+}
+
+static rbusError_t param_get(rbusHandle_t handle, rbusProperty_t property, rbusGetHandlerOptions_t *options) {
+   (void)handle;
+   (void)options;
+   inject_latency();
+   int index = param_index(rbusProperty_GetName(property));
+   if (index < 0) {
+      return RBUS_ERROR_ELEMENT_DOES_NOT_EXIST;
+   }
+   pthread_mutex_lock(&model_lock);
+   rbusProperty_SetValue(property, param_values[index]);
+   pthread_mutex_unlock(&model_lock);
+   return RBUS_ERROR_SUCCESS;
+}
+
+static rbusError_t param_set(rbusHandle_t handle, rbusProperty_t property, rbusSetHandlerOptions_t *options) {
+   (void)handle;
+   (void)options;
+   inject_latency();
+   int index = param_index(rbusProperty_GetName(property));
+   if (index < 0) {
+      return RBUS_ERROR_ELEMENT_DOES_NOT_EXIST;
+   }
+   rbusValue_t value = rbusProperty_GetValue(property);
+   pthread_mutex_lock(&model_lock);
+   if (rbusValue_GetType(value) != rbusValue_GetType(param_values[index])) {
+      pthread_mutex_unlock(&model_lock);
+      return RBUS_ERROR_INVALID_INPUT;
+   }
+   rbusValue_Copy(param_values[index], value);
+   pthread_mutex_unlock(&model_lock);
+   return RBUS_ERROR_SUCCESS;
+}
+
+// Let rbus poll parameters for value-change subscriptions
+static rbusError_t param_subscribe(rbusHandle_t handle, rbusEventSubAction_t action, const char *eventName,
+   rbusFilter_t filter, int32_t interval, bool *autoPublish) {
+   (void)handle;
+   (void)action;
+   (void)eventName;
+   (void)filter;
+   (void)interval;
+   *autoPublish = true;
+   return RBUS_ERROR_SUCCESS;
+}
+
+// Table rows expose their instance number and a derived value
+static rbusError_t row_get(rbusHandle_t handle, rbusProperty_t property, rbusGetHandlerOptions_t *options) {
+   (void)handle;
+   (void)options;
+   inject_latency();
+   const char *name = rbusProperty_GetName(property);
+   const char *field = strrchr(name, '.');
+   const char *row = field;
+   while (row > name && row[-1] != '.') {
+      row--;
+   }
+   unsigned int instance = (unsigned int)strtoul(row, NULL, 10);
+
+   rbusValue_t value;
+   rbusValue_Init(&value);
+   if (strcmp(field, ".Name") == 0) {
+      char text[32];
+      snprintf(text, sizeof(text), "row-%u", instance);
+      rbusValue_SetString(value, text);
+   } else {
+      rbusValue_SetUInt32(value, instance * 10);
+   }
+   rbusProperty_SetValue(property, value);
+   rbusValue_Release(value);
+   return RBUS_ERROR_SUCCESS;
+}
+
+static rbusError_t row_add(rbusHandle_t handle, const char *tableName, const char *aliasName, uint32_t *instNum) {
+   (void)handle;
+   (void)tableName;
+   (void)aliasName;
+   static uint32_t next_instance = 100000;
+   *instNum = __atomic_add_fetch(&next_instance, 1, __ATOMIC_RELAXED);
+   return RBUS_ERROR_SUCCESS;
+}
+
+static rbusError_t row_remove(rbusHandle_t handle, const char *rowName) {
+   (void)handle;
+   (void)rowName;
+   return RBUS_ERROR_SUCCESS;
+}
+
+// Index of Device.Mock.EventN!, or -1
+static int event_index(const char *name) {
+   if (strncmp(name, EVENT_PREFIX, strlen(EVENT_PREFIX)) != 0) {
+      return -1;
+   }
+   int index = atoi(name + strlen(EVENT_PREFIX)) - 1;
+   return index >= 0 && index < event_count ? index : -1;
+}
+
+static rbusError_t event_subscribe(rbusHandle_t handle, rbusEventSubAction_t action, const char *eventName,
+   rbusFilter_t filter, int32_t interval, bool *autoPublish) {
+   (void)handle;
+   (void)filter;
+   (void)interval;
+   *autoPublish = false;
+   int index = event_index(eventName);
+   if (index < 0) {
+      return RBUS_ERROR_INVALID_EVENT;
+   }
+   pthread_mutex_lock(&model_lock);
+   event_subscribers[index] += action == RBUS_EVENT_ACTION_SUBSCRIBE ? 1 : -1;
+   pthread_mutex_unlock(&model_lock);
+   return RBUS_ERROR_SUCCESS;
+}
+
+// Publish every subscribed event source event_rate times a second
+static void *publisher_thread(void *arg) {
+   rbusHandle_t handle = (rbusHandle_t)arg;
+   struct timespec next;
+   clock_gettime(CLOCK_MONOTONIC, &next);
+   long period_ns = 1000000000L / event_rate;
+   uint32_t counter = 0;
+
+   while (!shutdown_flag) {
+      next.tv_nsec += period_ns;
+      while (next.tv_nsec >= 1000000000L) {
+         next.tv_nsec -= 1000000000L;
+         next.tv_sec++;
+      }
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+      counter++;
+
+      for (int i = 0; i < event_count; i++) {
+         pthread_mutex_lock(&model_lock);
+         bool subscribed = event_subscribers[i] > 0;
+         pthread_mutex_unlock(&model_lock);
+         if (!subscribed) {
+            continue;
+         }
+
+         char name[64];
+         snprintf(name, sizeof(name), EVENT_PREFIX "%d!", i + 1);
+         rbusObject_t data;
+         rbusValue_t value;
+         rbusObject_Init(&data, NULL);
+         rbusValue_Init(&value);
+         rbusValue_SetUInt32(value, counter);
+         rbusObject_SetValue(data, "value", value);
+         rbusValue_Release(value);
+
+         rbusEvent_t event = { .name = name, .type = RBUS_EVENT_GENERAL, .data = data };
+         rbusError_t err = rbusEvent_Publish(handle, &event);
+         if (err != RBUS_ERROR_SUCCESS && err != RBUS_ERROR_NOSUBSCRIBERS) {
+            fprintf(stderr, "Warning: publishing %s failed: %s\n", name, rbusError_ToString(err));
+         }
+         rbusObject_Release(data);
+      }
+   }
+   return NULL;
+}
+
+// Build the element list. Names are heap-allocated and freed by free_elements.
+static rbusDataElement_t *build_elements(int *count) {
+   int total = param_count + table_count * 3 + event_count;
+   rbusDataElement_t *elements = calloc(total ? total : 1, sizeof(rbusDataElement_t));
+   if (!elements) {
+      return NULL;
+   }
+
+   int n = 0;
+   char name[128];
+   for (int i = 0; i < param_count; i++) {
+      snprintf(name, sizeof(name), PARAM_PREFIX "%d", i + 1);
+      elements[n].name = strdup(name);
+      elements[n].type = RBUS_ELEMENT_TYPE_PROPERTY;
+      elements[n].cbTable.getHandler = param_get;
+      elements[n].cbTable.setHandler = param_set;
+      elements[n].cbTable.eventSubHandler = param_subscribe;
+      n++;
+   }
+   for (int t = 0; t < table_count; t++) {
+      snprintf(name, sizeof(name), TABLE_PREFIX "%d.{i}.", t + 1);
+      elements[n].name = strdup(name);
+      elements[n].type = RBUS_ELEMENT_TYPE_TABLE;
+      elements[n].cbTable.tableAddRowHandler = row_add;
+      elements[n].cbTable.tableRemoveRowHandler = row_remove;
+      n++;
+      snprintf(name, sizeof(name), TABLE_PREFIX "%d.{i}.Value", t + 1);
+      elements[n].name = strdup(name);
+      elements[n].type = RBUS_ELEMENT_TYPE_PROPERTY;
+      elements[n].cbTable.getHandler = row_get;
+      n++;
+      snprintf(name, sizeof(name), TABLE_PREFIX "%d.{i}.Name", t + 1);
+      elements[n].name = strdup(name);
+      elements[n].type = RBUS_ELEMENT_TYPE_PROPERTY;
+      elements[n].cbTable.getHandler = row_get;
+      n++;
+   }
+   for (int e = 0; e < event_count; e++) {
+      snprintf(name, sizeof(name), EVENT_PREFIX "%d!", e + 1);
+      elements[n].name = strdup(name);
+      elements[n].type = RBUS_ELEMENT_TYPE_EVENT;
+      elements[n].cbTable.eventSubHandler = event_subscribe;
+      n++;
+   }
+
+   for (int i = 0; i < n; i++) {
+      if (!elements[i].name) {
+         for (int j = 0; j < n; j++) {
+            free(elements[j].name);
+         }
+         free(elements);
+         return NULL;
+      }
+   }
+   *count = n;
+   return elements;
+}
+
+static void free_elements(rbusDataElement_t *elements, int count) {
+   for (int i = 0; i < count; i++) {
+      free(elements[i].name);
+   }
+   free(elements);
+}
+
+// Initial parameter values cycle through string, int, bool and double
+static int init_params(void) {
+   param_values = calloc(param_count, sizeof(rbusValue_t));
+   if (!param_values) {
+      return -1;
+   }
+   for (int i = 0; i < param_count; i++) {
+      rbusValue_Init(&param_values[i]);
+      switch (i % 4) {
+      case 0: {
+         char text[32];
+         snprintf(text, sizeof(text), "value-%d", i + 1);
+         rbusValue_SetString(param_values[i], text);
+         break;
+      }
+      case 1:
+         // Int64 is what the gateway builds from JSON integers, and
+         // param_set requires the stored type
+         rbusValue_SetInt64(param_values[i], i + 1);
+         break;
+      case 2:
+         rbusValue_SetBoolean(param_values[i], (i / 4) % 2 == 0);
+         break;
+      default:
+         rbusValue_SetDouble(param_values[i], (i + 1) * 0.5);
+         break;
+      }
+   }
+   return 0;
+}
+
+static void usage(const char *name) {
+   fprintf(stderr,
+      "Usage: %s [-p params] [-t tables] [-r rows] [-e events] [-R event_rate] [-l latency_us] [-j jitter_us]\n",
+      name);
+}
+
+int main(int argc, char *argv[]) {
+   int opt;
+   while ((opt = getopt(argc, argv, "p:t:r:e:R:l:j:h")) != -1) {
+      switch (opt) {
+      case 'p': param_count = atoi(optarg); break;
+      case 't': table_count = atoi(optarg); break;
+      case 'r': row_count = atoi(optarg); break;
+      case 'e': event_count = atoi(optarg); break;
+      case 'R': event_rate = atoi(optarg); break;
+      case 'l': latency_us = atoi(optarg); break;
+      case 'j': jitter_us = atoi(optarg); break;
+      default:
+         usage(argv[0]);
+         return 1;
+      }
+   }
+   if (param_count < 0 || table_count < 0 || row_count < 0 || event_count < 0 || event_rate <= 0 ||
+      event_rate > 1000000 || latency_us < 0 || jitter_us < 0) {
+      usage(argv[0]);
+      return 1;
+   }
+
+   signal(SIGINT, handle_signal);
+   signal(SIGTERM, handle_signal);
+   rbus_setLogLevel(RBUS_LOG_ERROR);
+
+   event_subscribers = calloc(event_count ? event_count : 1, sizeof(int));
+   if (!event_subscribers || init_params() != 0) {
+      fprintf(stderr, "Error: Out of memory\n");
+      return 1;
+   }
+
+   rbusHandle_t handle;
+   if (rbus_open(&handle, "rbus-mock-provider") != RBUS_ERROR_SUCCESS) {
+      fprintf(stderr, "Error: failed to open rbus handle\n");
+      return 1;
+   }
+
+   int element_count = 0;
+   rbusDataElement_t *elements = build_elements(&element_count);
+   if (!elements) {
+      fprintf(stderr, "Error: Out of memory\n");
+      rbus_close(handle);
+      return 1;
+   }
+   rbusError_t err = rbus_regDataElements(handle, element_count, elements);
+   if (err != RBUS_ERROR_SUCCESS) {
+      fprintf(stderr, "Error: rbus_regDataElements failed: %s\n", rbusError_ToString(err));
+      free_elements(elements, element_count);
+      rbus_close(handle);
+      return 1;
+   }
+
+   for (int t = 0; t < table_count; t++) {
+      char table[64];
+      snprintf(table, sizeof(table), TABLE_PREFIX "%d.", t + 1);
+      for (int r = 0; r < row_count; r++) {
+         err = rbusTable_registerRow(handle, table, (uint32_t)(r + 1), NULL);
+         if (err != RBUS_ERROR_SUCCESS) {
+            fprintf(stderr, "Warning: registering row %s%d failed: %s\n", table, r + 1, rbusError_ToString(err));
+         }
+      }
+   }
+
+   pthread_t publisher;
+   bool publishing = event_count > 0 && pthread_create(&publisher, NULL, publisher_thread, handle) == 0;
+
+   printf("Mock provider running: %d params, %d tables x %d rows, %d events at %d/s, latency %d+%d us\n",
+      param_count, table_count, row_count, event_count, event_rate, latency_us, jitter_us);
+   while (!shutdown_flag) {
+      sleep(1);
+   }
+
+   if (publishing) {
+      pthread_join(publisher, NULL);
+   }
+   rbus_unregDataElements(handle, element_count, elements);
+   free_elements(elements, element_count);
+   rbus_close(handle);
+   for (int i = 0; i < param_count; i++) {
+      rbusValue_Release(param_values[i]);
+   }
+   free(param_values);
+   free(event_subscribers);
+   return 0;
+}
@@ -0,0 +1,389 @@
+// In-process stand-in for the rbus bus API, for benchmarking the gateway with
+// no broker or providers. Linked into the executable ahead of librbus, these
+// definitions take precedence over the library's bus calls while librbus still
+// supplies rbusValue/rbusObject/rbusProperty.
+//
+// Parameters live in an in-memory table: gets of unknown names return a string,
+// sets are stored and published as value changes to subscribers. Tuned by
+// environment variables:
+//   RBUS_STUB_LATENCY_US  Delay added to every get, set and subscribe (default 0)
+//   RBUS_STUB_EVENT_RATE  Value changes published per second per subscription (default 0)
+//   RBUS_STUB_TABLE_ROWS  Rows reported by rbusTable_getRowNames (default 4)
+#include <rbus.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+typedef struct StubParam {
+   char *name;
+   rbusValue_t value;
+   struct StubParam *next;
+} StubParam;
+
+typedef struct StubSubscription {
+   rbusEventSubscription_t sub; // Copy handed to the handler, with its own name
+   uint32_t counter;            // Last synthetic value published
+   struct StubSubscription *next;
+} StubSubscription;
+
+// Events waiting for the dispatch thread
+typedef struct StubEvent {
+   char *name;
+   rbusEventType_t type;
+   rbusValue_t value;
+   struct StubEvent *next;
+} StubEvent;
+
+static struct _rbusHandle {
+   int open_count;
+} stub_handle;
+
+// stub_lock guards everything below and is held while handlers run, so an
+// unsubscribed entry is never freed under a running handler
+static pthread_mutex_t stub_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stub_cond = PTHREAD_COND_INITIALIZER;
+static StubParam *params = NULL;
+static StubSubscription *stub_subscriptions = NULL;
+static StubEvent *events_head = NULL;
+static StubEvent **events_tail = &events_head;
+static pthread_t dispatch_thread;
+static bool running = false;
+
+static int latency_us = 0;
+static int event_rate = 0;
+static int table_rows = 4;
+
+static int env_int(const char *name, int fallback) {
+   const char *value = getenv(name);
+   return value && *value ? atoi(value) : fallback;
+}
+
+static void stub_delay(void) {
+   if (latency_us > 0) {
+      struct timespec ts = { latency_us / 1000000, (long)(latency_us % 1000000) * 1000 };
+      nanosleep(&ts, NULL);
+   }
+}
+
+// Find a parameter, creating it with a string value on first use (stub_lock held)
+static StubParam *stub_param(const char *name) {
+   for (StubParam *p = params; p; p = p->next) {
+      if (strcmp(p->name, name) == 0) {
+         return p;
+      }
+   }
+   StubParam *p = calloc(1, sizeof(StubParam));
+   if (!p || !(p->name = strdup(name))) {
+      free(p);
+      return NULL;
+   }
+   rbusValue_Init(&p->value);
+   rbusValue_SetString(p->value, "stub");
+   p->next = params;
+   params = p;
+   return p;
+}
+
+// Queue an event carrying a copy of value for the dispatch thread (stub_lock held)
+static void stub_queue_event(const char *name, rbusEventType_t type, rbusValue_t value) {
+   StubEvent *event = calloc(1, sizeof(StubEvent));
+   if (!event || !(event->name = strdup(name))) {
+      free(event);
+      return;
+   }
+   event->type = type;
+   rbusValue_Init(&event->value);
+   rbusValue_Copy(event->value, value);
+   *events_tail = event;
+   events_tail = &event->next;
+   pthread_cond_signal(&stub_cond);
+}
+
+// Call the handler of every subscription to name (stub_lock held)
+static void stub_deliver(const char *name, rbusEventType_t type, rbusValue_t value) {
+   rbusObject_t data;
+   rbusObject_Init(&data, NULL);
+   rbusObject_SetValue(data, "value", value);
+   rbusEvent_t event = { .name = name, .type = type, .data = data };
+   for (StubSubscription *s = stub_subscriptions; s; s = s->next) {
+      if (strcmp(s->sub.eventName, name) == 0) {
+         ((rbusEventHandler_t)s->sub.handler)(&stub_handle, &event, &s->sub);
+      }
+   }
+   rbusObject_Release(data);
+}
+
+// Delivers queued events and, with RBUS_STUB_EVENT_RATE set, a steady stream of
+// value changes to every subscription, on a thread of its own as rbus does
+static void *stub_dispatch(void *arg) {
+   (void)arg;
+   struct timespec next;
+   clock_gettime(CLOCK_MONOTONIC, &next);
+   long period_ns = event_rate > 0 ? 1000000000L / event_rate : 100000000L;
+
+   pthread_mutex_lock(&stub_lock);
+   while (running) {
+      while (events_head) {
+         StubEvent *event = events_head;
+         events_head = event->next;
+         if (!events_head) {
+            events_tail = &events_head;
+         }
+         stub_deliver(event->name, event->type, event->value);
+         rbusValue_Release(event->value);
+         free(event->name);
+         free(event);
+      }
+
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (event_rate > 0 && (now.tv_sec > next.tv_sec || (now.tv_sec == next.tv_sec && now.tv_nsec >= next.tv_nsec))) {
+         for (StubSubscription *s = stub_subscriptions; s; s = s->next) {
+            rbusValue_t value;
+            rbusValue_Init(&value);
+            rbusValue_SetUInt32(value, ++s->counter);
+            stub_deliver(s->sub.eventName, RBUS_EVENT_VALUE_CHANGED, value);
+            rbusValue_Release(value);
+         }
+         next.tv_nsec += period_ns;
+         while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+         }
+      }
+
+      // stub_cond uses the default realtime clock, so wait for at most one period
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += period_ns;
+      while (deadline.tv_nsec >= 1000000000L) {
+         deadline.tv_nsec -= 1000000000L;
+         deadline.tv_sec++;
+      }
+      if (!events_head && running) {
+         pthread_cond_timedwait(&stub_cond, &stub_lock, &deadline);
+      }
+   }
+   pthread_mutex_unlock(&stub_lock);
+   return NULL;
+}
+
+rbusError_t rbus_open(rbusHandle_t *handle, char const *componentName) {
+   (void)componentName;
+   pthread_mutex_lock(&stub_lock);
+   if (stub_handle.open_count++ == 0) {
+      latency_us = env_int("RBUS_STUB_LATENCY_US", 0);
+      event_rate = env_int("RBUS_STUB_EVENT_RATE", 0);
+      table_rows = env_int("RBUS_STUB_TABLE_ROWS", 4);
+      running = true;
+      if (pthread_create(&dispatch_thread, NULL, stub_dispatch, NULL) != 0) {
+         running = false;
+         stub_handle.open_count--;
+         pthread_mutex_unlock(&stub_lock);
+         return RBUS_ERROR_OUT_OF_RESOURCES;
+      }
+   }
+   pthread_mutex_unlock(&stub_lock);
+   *handle = &stub_handle;
+   return RBUS_ERROR_SUCCESS;
+}
+
+rbusError_t rbus_close(rbusHandle_t handle) {
+   if (handle != &stub_handle) {
+      return RBUS_ERROR_INVALID_HANDLE;
+   }
+   pthread_mutex_lock(&stub_lock);
+   bool last = --stub_handle.open_count == 0;
+   if (last) {
+      running = false;
+      pthread_cond_signal(&stub_cond);
+   }
+   pthread_mutex_unlock(&stub_lock);
+   if (!last) {
+      return RBUS_ERROR_SUCCESS;
+   }
+
+   pthread_join(dispatch_thread, NULL);
+   while (params) {
+      StubParam *p = params;
+      params = p->next;
+      rbusValue_Release(p->value);
+      free(p->name);
+      free(p);
+   }
+   while (stub_subscriptions) {
+      StubSubscription *s = stub_subscriptions;
+      stub_subscriptions = s->next;
+      free((char *)s->sub.eventName);
+      free(s);
+   }
+   while (events_head) {
+      StubEvent *event = events_head;
+      events_head = event->next;
+      rbusValue_Release(event->value);
+      free(event->name);
+      free(event);
+   }
+   events_tail = &events_head;
+   return RBUS_ERROR_SUCCESS;
+}
+
+void rbus_setLogLevel(rbusLogLevel_t level) {
+   (void)level;
+}
+
+rbusError_t rbus_getExt(rbusHandle_t handle, int paramCount, char const **pParamNames, int *numProps,
+   rbusProperty_t *properties) {
+   if (handle != &stub_handle || paramCount <= 0) {
+      return RBUS_ERROR_INVALID_INPUT;
+   }
+   stub_delay();
+
+   rbusProperty_t first = NULL;
+   pthread_mutex_lock(&stub_lock);
+   for (int i = 0; i < paramCount; i++) {
+      StubParam *p = stub_param(pParamNames[i]);
+      if (!p) {
+         pthread_mutex_unlock(&stub_lock);
+         if (first) {
+            rbusProperty_Release(first);
+         }
+         return RBUS_ERROR_OUT_OF_RESOURCES;
+      }
+      rbusProperty_t prop;
+      rbusProperty_Init(&prop, p->name, p->value);
+      if (first) {
+         rbusProperty_Append(first, prop);
+         rbusProperty_Release(prop);
+      } else {
+         first = prop;
+      }
+   }
+   pthread_mutex_unlock(&stub_lock);
+
+   *numProps = paramCount;
+   *properties = first;
+   return RBUS_ERROR_SUCCESS;
+}
+
+rbusError_t rbus_set(rbusHandle_t handle, char const *name, rbusValue_t value, rbusSetOptions_t *opts) {
+   (void)opts;
+   if (handle != &stub_handle || !name || !value) {
+      return RBUS_ERROR_INVALID_INPUT;
+   }
+   stub_delay();
+
+   pthread_mutex_lock(&stub_lock);
+   StubParam *p = stub_param(name);
+   if (!p) {
+      pthread_mutex_unlock(&stub_lock);
+      return RBUS_ERROR_OUT_OF_RESOURCES;
+   }
+   bool changed = rbusValue_Compare(p->value, value) != 0;
+   rbusValue_Copy(p->value, value);
+   if (changed) {
+      stub_queue_event(name, RBUS_EVENT_VALUE_CHANGED, p->value);
+   }
+   pthread_mutex_unlock(&stub_lock);
+   return RBUS_ERROR_SUCCESS;
+}
+
+rbusError_t rbusEvent_SubscribeEx(rbusHandle_t handle, rbusEventSubscription_t *subscription, int numSubscriptions,
+   int timeout) {
+   (void)timeout;
+   if (handle != &stub_handle) {
+      return RBUS_ERROR_INVALID_HANDLE;
+   }
+   stub_delay();
+
+   pthread_mutex_lock(&stub_lock);
+   for (int i = 0; i < numSubscriptions; i++) {
+      for (StubSubscription *s = stub_subscriptions; s; s = s->next) {
+         if (strcmp(s->sub.eventName, subscription[i].eventName) == 0) {
+            pthread_mutex_unlock(&stub_lock);
+            return RBUS_ERROR_SUBSCRIPTION_ALREADY_EXIST;
+         }
+      }
+      StubSubscription *s = calloc(1, sizeof(StubSubscription));
+      char *name = s ? strdup(subscription[i].eventName) : NULL;
+      if (!name) {
+         free(s);
+         pthread_mutex_unlock(&stub_lock);
+         return RBUS_ERROR_OUT_OF_RESOURCES;
+      }
+      s->sub = subscription[i];
+      s->sub.eventName = name;
+      s->sub.handle = handle;
+      s->next = stub_subscriptions;
+      stub_subscriptions = s;
+
+      if (subscription[i].publishOnSubscribe) {
+         StubParam *p = stub_param(name);
+         if (p) {
+            stub_queue_event(name, RBUS_EVENT_INITIAL_VALUE, p->value);
+         }
+      }
+   }
+   pthread_mutex_unlock(&stub_lock);
+   return RBUS_ERROR_SUCCESS;
+}
+
+rbusError_t rbusEvent_Unsubscribe(rbusHandle_t handle, char const *eventName) {
+   if (handle != &stub_handle) {
+      return RBUS_ERROR_INVALID_HANDLE;
+   }
+   pthread_mutex_lock(&stub_lock);
+   for (StubSubscription **p = &stub_subscriptions; *p; p = &(*p)->next) {
+      if (strcmp((*p)->sub.eventName, eventName) == 0) {
+         StubSubscription *s = *p;
+         *p = s->next;
+         free((char *)s->sub.eventName);
+         free(s);
+         pthread_mutex_unlock(&stub_lock);
+         return RBUS_ERROR_SUCCESS;
+      }
+   }
+   pthread_mutex_unlock(&stub_lock);
+   return RBUS_ERROR_INVALID_EVENT;
+}
+
+// Every table has rows 1..RBUS_STUB_TABLE_ROWS
+rbusError_t rbusTable_getRowNames(rbusHandle_t handle, char const *tableName, rbusRowName_t **rowNames) {
+   if (handle != &stub_handle || !tableName) {
+      return RBUS_ERROR_INVALID_INPUT;
+   }
+   stub_delay();
+
+   rbusRowName_t *head = NULL;
+   for (int i = table_rows; i > 0; i--) {
+      rbusRowName_t *row = calloc(1, sizeof(rbusRowName_t));
+      char *name = row ? malloc(strlen(tableName) + 16) : NULL;
+      if (!name) {
+         free(row);
+         rbusTable_freeRowNames(handle, head);
+         return RBUS_ERROR_OUT_OF_RESOURCES;
+      }
+      sprintf(name, "%s%d.", tableName, i);
+      row->name = name;
+      row->instNum = (uint32_t)i;
+      row->inUse = true;
+      row->next = head;
+      head = row;
+   }
+   *rowNames = head;
+   return RBUS_ERROR_SUCCESS;
+}
+
+rbusError_t rbusTable_freeRowNames(rbusHandle_t handle, rbusRowName_t *rowNames) {
+   (void)handle;
+   while (rowNames) {
+      rbusRowName_t *next = rowNames->next;
+      free((char *)rowNames->name);
+      free(rowNames);
+      rowNames = next;
+   }
+   return RBUS_ERROR_SUCCESS;
+}